@@ -0,0 +1,286 @@
+#include "hooks/hooks.h"
+#include "backend.h"
+#include "session.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_SAMPLES 1000000 //!< Maximum number of timed grabs per run
+#define MOCK_FPS "240" //!< Rate at which the mock produces new frames
+
+typedef struct {
+    const char* name; //!< Name in the results
+    grab_mode mode; //!< Grab mode
+} bench_mode; //!< Grab mode to benchmark
+
+typedef struct {
+    int width, height; //!< Frame size
+} bench_size; //!< Resolution to benchmark
+
+static const bench_mode modes[] = {
+    { "nowait", GRAB_MODE_NOWAIT },
+    { "nowait_if_new_frame_ready", GRAB_MODE_NOWAIT_IF_NEW_FRAME_READY },
+    { "blocking", GRAB_MODE_BLOCKING }
+};
+
+static const bench_size sizes[] = {
+    { 1280, 720 },
+    { 1920, 1080 },
+    { 3840, 2160 }
+};
+
+static const capture_backend* backends[] = {
+    &togl_backend,
+    &tosys_backend,
+    &cpu_backend
+};
+
+static uint64_t samples[MAX_SAMPLES]; //!< Grab latencies of the current run in ns
+static uint64_t render_samples[MAX_SAMPLES]; //!< Render latencies of the current run in ns
+static uint8_t* render_target; //!< Frame-sized buffer system memory frames are copied into by render_frame()
+static volatile int shown_texture; //!< Texture render_frame() last switched to
+static uint64_t allocations; //!< Number of heap allocations since start
+static NvFBCCustomState state; //!< State the ToGL backend claims its buffer slots from
+static PNVFBCTOGLSETUP mock_togl_setup; //!< ToGL setup of the mock
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+
+void* __wrap_malloc(size_t size) { allocations++; return __real_malloc(size); }
+void* __wrap_calloc(size_t count, size_t size) { allocations++; return __real_calloc(count, size); }
+void* __wrap_realloc(void* ptr, size_t size) { allocations++; return __real_realloc(ptr, size); }
+
+/**
+ * Return the state the benchmark records the mock's ToGL buffers into, in place of the preload hooks
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \return
+ *   Hook state
+ */
+void* backend_hooks() {
+    return &state;
+}
+
+/**
+ * Set up ToGL capture in the mock and record fake capture buffers, like the hooks do for NvFBC's allocations
+ *
+ * There is neither GL nor Vulkan behind the mock, so the buffers are only
+ * handles. The ToGL backend never touches them while grabbing.
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param session
+ *   NvFBC session
+ * \param params
+ *   ToGL setup parameters
+ *
+ * \return
+ *   Status of the mock's setup
+ */
+static NVFBCSTATUS NVFBCAPI record_togl_setup(const NVFBC_SESSION_HANDLE session, NVFBC_TOGL_SETUP_PARAMS* params) {
+    NVFBCSTATUS status = mock_togl_setup(session, params);
+    hook_session* slot = hooks_recording_session(&state);
+    for (int i = 0; !status && slot && i < NVFBC_TOGL_TEXTURES_MAX; i++)
+        hooks_record_allocation(slot, VK_NULL_HANDLE, (VkDevice) (uintptr_t) 1, HOOKS_MIN_BUFFER_SIZE, (VkDeviceMemory) (uintptr_t) (i + 1));
+    return status;
+}
+
+/**
+ * Return the current monotonic time
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \return
+ *   Time in ns
+ */
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Compare two latencies for qsort
+ *
+ * \author
+ *   PancakeTAS
+ */
+static int compare_samples(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Return a percentile of sorted samples
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param sorted
+ *   Sorted samples
+ * \param count
+ *   Number of samples
+ * \param percentile
+ *   Percentile (0 to 100)
+ *
+ * \return
+ *   Latency in ns (0 without samples)
+ */
+static uint64_t percentile(const uint64_t* sorted, size_t count, double percentile) {
+    if (!count)
+        return 0;
+    size_t index = (size_t) (percentile / 100.0 * (count - 1) + 0.5);
+    return sorted[index < count ? index : count - 1];
+}
+
+/**
+ * Do the work render() does for a new frame, without OBS's graphics thread
+ *
+ * Texture backends only switch to the texture holding the frame, as the
+ * plugin draws it without a copy (the fence behind the draws needs GL, so it
+ * isn't covered). System memory frames are copied once into a frame-sized
+ * buffer, like OBS copies them into its frame cache before they are uploaded.
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param backend
+ *   Capture backend
+ * \param frame
+ *   Grabbed frame
+ * \param size
+ *   Size of render_target in bytes
+ */
+static void render_frame(const capture_backend* backend, const frame_info* frame, size_t size) {
+    if (backend->texture_count) {
+        shown_texture = frame->texture;
+        return;
+    }
+
+    size_t frame_size = (size_t) frame->linesize * frame->height;
+    memcpy(render_target, frame->data, frame_size < size ? frame_size : size);
+}
+
+/**
+ * Benchmark one backend, grab mode and resolution and print the result as JSON
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param backend
+ *   Capture backend
+ * \param mode
+ *   Grab mode
+ * \param size
+ *   Frame size
+ * \param duration
+ *   Time to grab for in ns
+ * \param first
+ *   Whether this is the first result
+ */
+static void run(const capture_backend* backend, const bench_mode* mode, const bench_size* size, uint64_t duration, bool first) {
+    char screen[32];
+    snprintf(screen, sizeof(screen), "%dx%d", size->width, size->height);
+    setenv("NVFBC_MOCK_SIZE", screen, 1);
+    fbc.dwVersion = NVFBC_VERSION;
+    if (NvFBCCreateInstance(&fbc)) {
+        fprintf(stderr, "Failed to create NvFBC instance\n");
+        exit(1);
+    }
+    mock_togl_setup = fbc.nvFBCToGLSetUp;
+    fbc.nvFBCToGLSetUp = record_togl_setup;
+
+    capture_params params = {
+        .frame_width = size->width,
+        .frame_height = size->height,
+        .push_model = true,
+        .mode = mode->mode,
+        .format = PIXEL_FORMAT_BGRA
+    };
+    backend->start(&params);
+    size_t target_size = (size_t) size->width * size->height * 4;
+    render_target = malloc(target_size);
+
+    // grab (and render every new frame) until the time is up
+    frame_info frame = { 0 };
+    size_t count = 0, render_count = 0;
+    uint64_t new_frames = 0, failures = 0;
+    uint64_t start_allocations = allocations;
+    uint64_t start = now_ns(), end = start + duration;
+    uint64_t now = start;
+    while (now < end && count < MAX_SAMPLES) {
+        bool captured = backend->grab(&params, &frame);
+        uint64_t after = now_ns();
+        samples[count++] = after - now;
+        now = after;
+
+        if (!captured) {
+            failures++;
+        } else if (frame.is_new) {
+            new_frames++;
+            render_frame(backend, &frame, target_size);
+            after = now_ns();
+            render_samples[render_count++] = after - now;
+            now = after;
+        }
+    }
+    uint64_t elapsed = now - start;
+    uint64_t grab_allocations = allocations - start_allocations;
+    backend->stop(&params);
+    free(render_target);
+
+    qsort(samples, count, sizeof(uint64_t), compare_samples);
+    qsort(render_samples, render_count, sizeof(uint64_t), compare_samples);
+    printf("%s\n    {\"backend\": \"%s\", \"mode\": \"%s\", \"width\": %d, \"height\": %d, "
+        "\"calls\": %zu, \"calls_per_second\": %.1f, \"new_frames\": %" PRIu64 ", \"failures\": %" PRIu64 ", "
+        "\"latency_ns\": {\"p50\": %" PRIu64 ", \"p99\": %" PRIu64 ", \"p99_9\": %" PRIu64 ", \"max\": %" PRIu64 "}, "
+        "\"render_ns\": {\"p50\": %" PRIu64 ", \"p99\": %" PRIu64 ", \"p99_9\": %" PRIu64 ", \"max\": %" PRIu64 "}, "
+        "\"allocations_per_frame\": %.3f}",
+        first ? "" : ",", backend->id, mode->name, size->width, size->height,
+        count, count / (elapsed / 1000000000.0), new_frames, failures,
+        percentile(samples, count, 50.0), percentile(samples, count, 99.0), percentile(samples, count, 99.9), percentile(samples, count, 100.0),
+        percentile(render_samples, render_count, 50.0), percentile(render_samples, render_count, 99.0),
+        percentile(render_samples, render_count, 99.9), percentile(render_samples, render_count, 100.0),
+        new_frames ? grab_allocations / (double) new_frames : 0.0);
+    fflush(stdout);
+}
+
+/**
+ * Benchmark the capture backends against the mock NvFBC for every grab mode and resolution
+ *
+ * Every grab is timed, and so is a headless stand-in for render() after
+ * every new frame (see render_frame()). The draw itself needs OBS's
+ * graphics thread, so the stage timings the plugin logs cover it instead.
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param argc
+ *   Argument count
+ * \param argv
+ *   Arguments (optional time per run in ms)
+ */
+int main(int argc, char** argv) {
+    uint64_t duration = (argc > 1 ? strtoull(argv[1], NULL, 10) : 1000) * 1000000ULL;
+
+    setenv("NVFBC_MOCK_FPS", MOCK_FPS, 0);
+
+    printf("{\n  \"mock_fps\": %s,\n  \"run_ms\": %" PRIu64 ",\n  \"results\": [", getenv("NVFBC_MOCK_FPS"), duration / 1000000);
+    bool first = true;
+    for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++)
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+            for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+                run(backends[b], &modes[m], &sizes[s], duration, first);
+                first = false;
+            }
+    printf("\n  ]\n}\n");
+    return 0;
+}
@@ -0,0 +1,107 @@
+#include "session.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <time.h>
+
+#define GRABS 1000000 //!< Number of grabs per run
+
+static uint64_t bind_calls; //!< Number of nvFBCBindContext calls
+static uint64_t release_calls; //!< Number of nvFBCReleaseContext calls
+static uint64_t grab_calls; //!< Number of nvFBCToGLGrabFrame calls
+static uint64_t call_cost_ns; //!< Simulated driver time per call
+
+/**
+ * Return the current monotonic time
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \return
+ *   Time in ns
+ */
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Spin for the simulated driver time
+ *
+ * \author
+ *   PancakeTAS
+ */
+static void driver_work() {
+    if (!call_cost_ns)
+        return;
+
+    uint64_t end = now_ns() + call_cost_ns;
+    while (now_ns() < end);
+}
+
+static NVFBCSTATUS stub_bind(const NVFBC_SESSION_HANDLE, NVFBC_BIND_CONTEXT_PARAMS*) { bind_calls++; driver_work(); return NVFBC_SUCCESS; }
+static NVFBCSTATUS stub_release(const NVFBC_SESSION_HANDLE, NVFBC_RELEASE_CONTEXT_PARAMS*) { release_calls++; driver_work(); return NVFBC_SUCCESS; }
+static NVFBCSTATUS stub_grab(const NVFBC_SESSION_HANDLE, NVFBC_TOGL_GRAB_FRAME_PARAMS* params) {
+    grab_calls++;
+    driver_work();
+    params->dwTextureIndex = grab_calls & 1;
+    return NVFBC_SUCCESS;
+}
+
+/**
+ * Run one benchmark and print its results
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param name
+ *   Name of the run
+ * \param per_frame
+ *   Whether to bind and release the context around every grab (the old behavior)
+ */
+static void run(const char* name, bool per_frame) {
+    fbc_session session = { .handle = 1 };
+    NVFBC_TOGL_GRAB_FRAME_PARAMS grab_params = { .dwVersion = NVFBC_TOGL_GRAB_FRAME_PARAMS_VER };
+    bind_calls = release_calls = grab_calls = 0;
+
+    uint64_t start = now_ns();
+    for (int i = 0; i < GRABS; i++) {
+        session_bind(&session);
+        fbc.nvFBCToGLGrabFrame(session.handle, &grab_params);
+        if (per_frame)
+            session_release(&session);
+    }
+    uint64_t elapsed = now_ns() - start;
+    session_release(&session);
+
+    printf("%-10s %8.2f ns/grab  %.3f binds/grab  %.3f releases/grab  %.3f driver calls/grab\n", name,
+        elapsed / (double) GRABS, bind_calls / (double) GRABS, release_calls / (double) GRABS,
+        (bind_calls + release_calls + grab_calls) / (double) GRABS);
+}
+
+/**
+ * Compare binding the NvFBC context per grab against owning it for the session
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param argc
+ *   Argument count
+ * \param argv
+ *   Arguments (optional simulated driver time per call in ns)
+ */
+int main(int argc, char** argv) {
+    if (argc > 1)
+        call_cost_ns = strtoull(argv[1], NULL, 10);
+
+    fbc.nvFBCBindContext = stub_bind;
+    fbc.nvFBCReleaseContext = stub_release;
+    fbc.nvFBCToGLGrabFrame = stub_grab;
+
+    printf("%d grabs, %" PRIu64 " ns simulated per driver call\n", GRABS, call_cost_ns);
+    run("per-frame", true);
+    run("owned", false);
+    return 0;
+}
@@ -0,0 +1,357 @@
+#include "hooks/hooks.h"
+
+#include <vulkan/vulkan.h>
+#include <libdrm/drm_fourcc.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#define BUFFER_SIZE (4 * 1024 * 1024) //!< Size of a large allocation that isn't a capture buffer
+#define SMALL_SIZE 4096 //!< Size of an allocation that is never a capture buffer
+#define IMAGE_SIZE 1024 //!< Width and height of the fake capture images
+
+static NvFBCCustomState state; //!< State the layer records into
+_Atomic(NvFBCCustomState*) nvfbc_layer_state; //!< State published for the layer, like the plugin does (exported with -rdynamic)
+
+typedef struct {
+    VkDevice device; //!< Device to allocate from
+    uint32_t type; //!< Memory type to allocate from
+    VkDeviceMemory memory; //!< Allocated memory
+} foreign_allocation; //!< Allocation made by a thread that isn't setting up a session
+
+/**
+ * Allocate device memory
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param device
+ *   Device to allocate from
+ * \param type
+ *   Memory type to allocate from
+ * \param size
+ *   Size of the allocation
+ * \param exportable
+ *   Whether the memory can be exported as an opaque fd
+ * \param image
+ *   Image the memory is dedicated to (VK_NULL_HANDLE for none)
+ *
+ * \return
+ *   Allocated memory, or VK_NULL_HANDLE on failure
+ */
+static VkDeviceMemory allocate(VkDevice device, uint32_t type, VkDeviceSize size, bool exportable, VkImage image) {
+    VkMemoryDedicatedAllocateInfo dedicated_info = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_ALLOCATE_INFO,
+        .image = image
+    };
+    VkExportMemoryAllocateInfo export_info = {
+        .sType = VK_STRUCTURE_TYPE_EXPORT_MEMORY_ALLOCATE_INFO,
+        .pNext = image ? &dedicated_info : NULL,
+        .handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_OPAQUE_FD_BIT
+    };
+    VkMemoryAllocateInfo info = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+        .pNext = exportable ? (void*) &export_info : image ? (void*) &dedicated_info : NULL,
+        .allocationSize = size,
+        .memoryTypeIndex = type
+    };
+    VkDeviceMemory memory = VK_NULL_HANDLE;
+    if (vkAllocateMemory(device, &info, NULL, &memory) != VK_SUCCESS)
+        return VK_NULL_HANDLE;
+    return memory;
+}
+
+/**
+ * Create a fake capture image and its memory, the way NvFBC does
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param device
+ *   Device to create the image on
+ * \param properties
+ *   Memory properties of the device
+ * \param exportable
+ *   Whether the memory can be exported as an opaque fd
+ * \param image
+ *   Created image (VK_NULL_HANDLE on failure)
+ * \param size
+ *   Size of the memory
+ *
+ * \return
+ *   Memory bound to the image, or VK_NULL_HANDLE on failure
+ */
+static VkDeviceMemory create_buffer(VkDevice device, const VkPhysicalDeviceMemoryProperties* properties, bool exportable, VkImage* image, VkDeviceSize* size) {
+    VkExternalMemoryImageCreateInfo external_info = {
+        .sType = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_IMAGE_CREATE_INFO,
+        .handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_OPAQUE_FD_BIT
+    };
+    *image = VK_NULL_HANDLE;
+    VkResult res = vkCreateImage(device, &(VkImageCreateInfo) {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+        .pNext = exportable ? &external_info : NULL,
+        .imageType = VK_IMAGE_TYPE_2D,
+        .format = VK_FORMAT_B8G8R8A8_UNORM,
+        .extent = { IMAGE_SIZE, IMAGE_SIZE, 1 },
+        .mipLevels = 1,
+        .arrayLayers = 1,
+        .samples = VK_SAMPLE_COUNT_1_BIT,
+        .tiling = VK_IMAGE_TILING_OPTIMAL,
+        .usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+        .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+        .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED
+    }, NULL, image);
+    if (res != VK_SUCCESS)
+        return VK_NULL_HANDLE;
+
+    // (the first device local type the image can live in)
+    VkMemoryRequirements requirements;
+    vkGetImageMemoryRequirements(device, *image, &requirements);
+    uint32_t type = UINT32_MAX;
+    for (uint32_t i = properties->memoryTypeCount; i-- > 0;) {
+        if ((requirements.memoryTypeBits & (1u << i)) && (properties->memoryTypes[i].propertyFlags & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT))
+            type = i;
+    }
+    VkDeviceMemory memory = type != UINT32_MAX ? allocate(device, type, requirements.size, exportable, *image) : VK_NULL_HANDLE;
+    if (!memory || vkBindImageMemory(device, *image, memory, 0) != VK_SUCCESS) {
+        vkFreeMemory(device, memory, NULL);
+        vkDestroyImage(device, *image, NULL);
+        *image = VK_NULL_HANDLE;
+        return VK_NULL_HANDLE;
+    }
+    *size = requirements.size;
+    return memory;
+}
+
+/**
+ * Allocate a large buffer on a thread that isn't setting up a session
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param data
+ *   Foreign allocation
+ */
+static void* allocate_foreign(void* data) {
+    foreign_allocation* allocation = (foreign_allocation*) data;
+    allocation->memory = allocate(allocation->device, allocation->type, BUFFER_SIZE, false, VK_NULL_HANDLE);
+    return NULL;
+}
+
+/**
+ * Check whether the Vulkan loader finds the layer
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \return
+ *   True if the layer is listed, false otherwise
+ */
+static bool layer_listed() {
+    uint32_t count = 0;
+    vkEnumerateInstanceLayerProperties(&count, NULL);
+    VkLayerProperties* layers = calloc(count ? count : 1, sizeof(VkLayerProperties));
+    vkEnumerateInstanceLayerProperties(&count, layers);
+
+    bool found = false;
+    for (uint32_t i = 0; i < count && !found; i++)
+        found = !strcmp(layers[i].layerName, HOOKS_LAYER_NAME);
+    free(layers);
+    return found;
+}
+
+/**
+ * Check whether a device supports an extension
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param physical_device
+ *   Physical device
+ * \param name
+ *   Name of the extension
+ *
+ * \return
+ *   True if the extension is supported, false otherwise
+ */
+static bool has_extension(VkPhysicalDevice physical_device, const char* name) {
+    uint32_t count = 0;
+    vkEnumerateDeviceExtensionProperties(physical_device, NULL, &count, NULL);
+    VkExtensionProperties* extensions = calloc(count ? count : 1, sizeof(VkExtensionProperties));
+    vkEnumerateDeviceExtensionProperties(physical_device, NULL, &count, extensions);
+
+    bool found = false;
+    for (uint32_t i = 0; i < count && !found; i++)
+        found = !strcmp(extensions[i].extensionName, name);
+    free(extensions);
+    return found;
+}
+
+/**
+ * Allocate fake capture buffers through the layer, the way the plugin and NvFBC do, and check what it recorded
+ *
+ * Run it through `make check-layer`, which points the Vulkan loader at the
+ * layer and at lavapipe (LVP_ICD=... selects another driver). It also checks
+ * that every free reaches the plugin's state, that freeing other memory
+ * leaves the capture buffers' cached imports valid, and, where the driver
+ * supports modifiers, that the images were created linear and their memory
+ * exports as a DMA-BUF.
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \return
+ *   Exit code, 0 if the layer recorded and exported the buffers
+ */
+int main() {
+    // publish the state and claim a slot like the plugin does
+    atomic_store(&nvfbc_layer_state, &state);
+    bool listed = layer_listed();
+
+    // (lavapipe and most drivers can lay out BGRA images linearly)
+    hook_session* session = &state.sessions[0];
+    session->owner = pthread_self();
+    session->modifiers[0] = DRM_FORMAT_MOD_LINEAR;
+    session->modifier_count = 1;
+    atomic_store(&session->state, HOOK_SESSION_RECORDING);
+
+    // create a device that can export memory, like NvFBC's (the plugin enables the layer on NvFBC's instance the same way)
+    const char* layers[] = { HOOKS_LAYER_NAME };
+    VkInstance instance;
+    VkResult res = vkCreateInstance(&(VkInstanceCreateInfo) {
+        .sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO,
+        .pApplicationInfo = &(VkApplicationInfo) {
+            .sType = VK_STRUCTURE_TYPE_APPLICATION_INFO,
+            .pApplicationName = "nvfbc-layer-check",
+            .apiVersion = VK_API_VERSION_1_1
+        },
+        .enabledLayerCount = listed ? 1 : 0,
+        .ppEnabledLayerNames = layers
+    }, NULL, &instance);
+    if (res != VK_SUCCESS) {
+        fprintf(stderr, "Failed to create Vulkan instance: %d\n", res);
+        return 1;
+    }
+
+    uint32_t physical_count = 1;
+    VkPhysicalDevice physical_device;
+    res = vkEnumeratePhysicalDevices(instance, &physical_count, &physical_device);
+    if ((res != VK_SUCCESS && res != VK_INCOMPLETE) || !physical_count) {
+        fprintf(stderr, "No Vulkan device found\n");
+        vkDestroyInstance(instance, NULL);
+        return 1;
+    }
+
+    bool exportable = has_extension(physical_device, VK_KHR_EXTERNAL_MEMORY_FD_EXTENSION_NAME);
+    const char* extensions[] = { VK_KHR_EXTERNAL_MEMORY_FD_EXTENSION_NAME };
+    VkDevice device;
+    res = vkCreateDevice(physical_device, &(VkDeviceCreateInfo) {
+        .sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
+        .queueCreateInfoCount = 1,
+        .pQueueCreateInfos = &(VkDeviceQueueCreateInfo) {
+            .sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+            .queueFamilyIndex = 0,
+            .queueCount = 1,
+            .pQueuePriorities = &(float) { 1.0f }
+        },
+        .enabledExtensionCount = exportable ? 1 : 0,
+        .ppEnabledExtensionNames = extensions
+    }, NULL, &device);
+    if (res != VK_SUCCESS) {
+        fprintf(stderr, "Failed to create Vulkan device: %d\n", res);
+        vkDestroyInstance(instance, NULL);
+        return 1;
+    }
+
+    VkPhysicalDeviceMemoryProperties properties;
+    vkGetPhysicalDeviceMemoryProperties(physical_device, &properties);
+    uint32_t type = 0;
+    for (uint32_t i = properties.memoryTypeCount; i-- > 0;) {
+        if (properties.memoryTypes[i].propertyFlags & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT)
+            type = i;
+    }
+
+    // only the two large allocations of this thread are capture buffers
+    VkDeviceMemory small = allocate(device, type, SMALL_SIZE, false, VK_NULL_HANDLE);
+    foreign_allocation foreign = { .device = device, .type = type };
+    pthread_t thread;
+    pthread_create(&thread, NULL, allocate_foreign, &foreign);
+    pthread_join(thread, NULL);
+    VkDeviceMemory buffers[NVFBC_TOGL_TEXTURES_MAX];
+    VkImage images[NVFBC_TOGL_TEXTURES_MAX];
+    VkDeviceSize sizes[NVFBC_TOGL_TEXTURES_MAX] = { 0 };
+    for (int i = 0; i < NVFBC_TOGL_TEXTURES_MAX; i++)
+        buffers[i] = create_buffer(device, &properties, exportable, &images[i], &sizes[i]);
+    atomic_store(&session->state, HOOK_SESSION_RECORDED);
+
+    bool recorded = session->count == NVFBC_TOGL_TEXTURES_MAX && session->device == device && session->instance == instance;
+    for (int i = 0; i < NVFBC_TOGL_TEXTURES_MAX; i++)
+        recorded &= session->memory[i] == buffers[i] && session->size[i] == sizes[i];
+
+    // where the device can share images with a modifier, the layer creates them linear and makes their memory a DMA-BUF
+    bool modifiers = exportable && has_extension(physical_device, VK_EXT_IMAGE_DRM_FORMAT_MODIFIER_EXTENSION_NAME)
+        && has_extension(physical_device, VK_EXT_EXTERNAL_MEMORY_DMA_BUF_EXTENSION_NAME)
+        && has_extension(physical_device, VK_KHR_IMAGE_FORMAT_LIST_EXTENSION_NAME);
+    int shared = 0;
+    PFN_vkGetMemoryFdKHR vkGetMemoryFdKHR = (PFN_vkGetMemoryFdKHR) vkGetInstanceProcAddr(session->instance, "vkGetMemoryFdKHR");
+    for (int i = 0; i < NVFBC_TOGL_TEXTURES_MAX && modifiers && vkGetMemoryFdKHR && session->device; i++) {
+        hook_image* image = &session->bound[i];
+        int fd = -1;
+        if (image->image == images[i] && image->modifier == DRM_FORMAT_MOD_LINEAR && image->width == IMAGE_SIZE && image->stride >= IMAGE_SIZE * 4
+            && vkGetMemoryFdKHR(session->device, &(VkMemoryGetFdInfoKHR) {
+                .sType = VK_STRUCTURE_TYPE_MEMORY_GET_FD_INFO_KHR,
+                .memory = session->memory[i],
+                .handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT
+            }, &fd) == VK_SUCCESS && fd >= 0) {
+            shared++;
+            close(fd);
+        }
+    }
+
+    // export the recorded buffers the way the ToGL backend does
+    int exported = 0;
+    for (int i = 0; i < NVFBC_TOGL_TEXTURES_MAX && exportable && vkGetMemoryFdKHR && session->device; i++) {
+        int fd = -1;
+        if (vkGetMemoryFdKHR(session->device, &(VkMemoryGetFdInfoKHR) {
+                .sType = VK_STRUCTURE_TYPE_MEMORY_GET_FD_INFO_KHR,
+                .memory = session->memory[i],
+                .handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_OPAQUE_FD_BIT
+            }, &fd) == VK_SUCCESS && fd >= 0) {
+            exported++;
+            close(fd);
+        }
+    }
+
+    // every free has to reach the plugin, but only a buffer's own free invalidates its cached imports
+    uint64_t freed = 0;
+    uint64_t since[NVFBC_TOGL_TEXTURES_MAX] = { 0 };
+    freed += (foreign.memory != VK_NULL_HANDLE) + (small != VK_NULL_HANDLE);
+    vkFreeMemory(device, foreign.memory, NULL);
+    vkFreeMemory(device, small, NULL);
+    bool kept = true;
+    for (int i = 0; i < NVFBC_TOGL_TEXTURES_MAX; i++)
+        kept &= !hooks_freed_since(&state, buffers[i], &since[i]);
+    for (int i = 0; i < NVFBC_TOGL_TEXTURES_MAX; i++) {
+        freed += buffers[i] != VK_NULL_HANDLE;
+        vkDestroyImage(device, images[i], NULL);
+        vkFreeMemory(device, buffers[i], NULL);
+    }
+    bool dropped = true;
+    for (int i = 0; i < NVFBC_TOGL_TEXTURES_MAX; i++)
+        dropped &= buffers[i] == VK_NULL_HANDLE || hooks_freed_since(&state, buffers[i], &since[i]);
+    vkDestroyDevice(device, NULL);
+    vkDestroyInstance(instance, NULL);
+
+    uint64_t frees = atomic_load(&state.frees);
+    bool ok = listed && recorded && (!exportable || exported == NVFBC_TOGL_TEXTURES_MAX) && (!modifiers || shared == NVFBC_TOGL_TEXTURES_MAX)
+        && frees == freed && kept && dropped;
+    printf("{\"layer\": %s, \"recorded\": %d, \"expected\": %d, \"exportable\": %s, \"exported\": %d, \"modifiers\": %s, \"shared\": %d, \"frees\": %" PRIu64 ", \"freed\": %" PRIu64 ", \"kept\": %s, \"dropped\": %s, \"ok\": %s}\n",
+        listed ? "true" : "false", session->count, NVFBC_TOGL_TEXTURES_MAX, exportable ? "true" : "false", exported,
+        modifiers ? "true" : "false", shared,
+        frees, freed, kept ? "true" : "false", dropped ? "true" : "false", ok ? "true" : "false");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,138 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#define DEFAULT_PLUGIN_DIR "/usr/lib/x86_64-linux-gnu/obs-plugins" //!< Where distributions install OBS plugins
+#define CALLS 1000000 //!< Number of dlopen and dlsym calls in the call benchmarks
+
+static const char* module_exports[] = {
+    "obs_module_load", "obs_module_unload", "obs_module_post_load", "obs_module_set_locale", "obs_module_free_locale",
+    "obs_module_ver", "obs_module_set_pointer", "obs_module_name", "obs_module_description", "obs_module_author"
+}; //!< Symbols OBS looks up in every plugin
+
+/**
+ * Return the current monotonic time
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \return
+ *   Time in ns
+ */
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Load every plugin in a directory the way OBS does
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param dir
+ *   Plugin directory
+ * \param loaded
+ *   Number of plugins that loaded
+ *
+ * \return
+ *   Time spent in dlopen and dlsym in ns
+ */
+static uint64_t load_plugins(const char* dir, int* loaded) {
+    *loaded = 0;
+    DIR* plugins = opendir(dir);
+    if (!plugins)
+        return 0;
+
+    uint64_t elapsed = 0;
+    struct dirent* entry;
+    char path[4096];
+    while ((entry = readdir(plugins))) {
+        size_t length = strlen(entry->d_name);
+        if (length < 3 || strcmp(entry->d_name + length - 3, ".so"))
+            continue;
+
+        // (plugins stay loaded, like they do in OBS)
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        uint64_t start = now_ns();
+        void* handle = dlopen(path, RTLD_LAZY);
+        if (handle) {
+            for (size_t i = 0; i < sizeof(module_exports) / sizeof(module_exports[0]); i++)
+                dlsym(handle, module_exports[i]);
+            (*loaded)++;
+        }
+        elapsed += now_ns() - start;
+    }
+
+    closedir(plugins);
+    return elapsed;
+}
+
+/**
+ * Measure dlopen, dlclose and dlsym calls on a library that is already loaded
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param dlopen_ns
+ *   Average time per dlopen in ns
+ * \param dlclose_ns
+ *   Average time per dlclose in ns
+ * \param dlsym_ns
+ *   Average time per dlsym in ns
+ */
+static void measure_calls(double* dlopen_ns, double* dlclose_ns, double* dlsym_ns) {
+    static void* handles[CALLS];
+    uint64_t start = now_ns();
+    for (int i = 0; i < CALLS; i++)
+        handles[i] = dlopen("libc.so.6", RTLD_NOW | RTLD_NOLOAD);
+    *dlopen_ns = (now_ns() - start) / (double) CALLS;
+
+    start = now_ns();
+    for (int i = 0; i < CALLS; i++)
+        dlsym(handles[0], (i & 1) ? "malloc" : "free");
+    *dlsym_ns = (now_ns() - start) / (double) CALLS;
+
+    start = now_ns();
+    for (int i = 0; i < CALLS; i++)
+        if (handles[i])
+            dlclose(handles[i]);
+    *dlclose_ns = (now_ns() - start) / (double) CALLS;
+}
+
+/**
+ * Measure plugin load time and dlopen/dlsym overhead of the current process
+ *
+ * Run it once plainly and once with LD_PRELOAD=preload.so to compare.
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param argc
+ *   Number of arguments
+ * \param argv
+ *   Arguments (optional plugin directory)
+ *
+ * \return
+ *   Exit code
+ */
+int main(int argc, char** argv) {
+    const char* dir = argc > 1 ? argv[1] : DEFAULT_PLUGIN_DIR;
+    const char* preload = getenv("LD_PRELOAD");
+
+    int loaded;
+    uint64_t plugin_ns = load_plugins(dir, &loaded);
+    double dlopen_ns, dlclose_ns, dlsym_ns;
+    measure_calls(&dlopen_ns, &dlclose_ns, &dlsym_ns);
+
+    printf("{\"preload\": \"%s\", \"plugin_dir\": \"%s\", \"plugins\": %d, \"plugin_load_ms\": %.3f, "
+        "\"dlopen_ns\": %.1f, \"dlclose_ns\": %.1f, \"dlsym_ns\": %.1f}\n",
+        preload ? preload : "", dir, loaded, plugin_ns / 1000000.0, dlopen_ns, dlclose_ns, dlsym_ns);
+    return 0;
+}
@@ -0,0 +1,629 @@
+#include <NvFBC.h>
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MOCK_BOX_SIZE 128 //!< Width and height of the moving box drawn into every frame
+#define MOCK_TEXTURE_BASE 0x1000 //!< First fake GL texture name handed out by ToGL setup
+
+typedef struct {
+    uint32_t width, height; //!< Screen size
+    uint64_t interval; //!< Time between two frames in ns
+    uint64_t latency; //!< Time added to every grab in ns
+    char new_frames[64]; //!< Pattern of bIsNewFrame values, cycled per grab (empty to follow the frame rate)
+    uint32_t fail_every; //!< Fail every n-th grab (0 to never fail)
+    NVFBCSTATUS fail_status; //!< Status returned by failing grabs
+} mock_config; //!< Mock configuration, read from the environment
+
+typedef struct {
+    char last_error[256]; //!< Last error message
+    pthread_mutex_t lock; //!< Lock protecting the context owner
+    bool bound; //!< Whether the context is bound to a thread
+    pthread_t owner; //!< Thread the context is bound to
+
+    bool has_session; //!< Whether a capture session exists
+    bool must_recreate; //!< Whether the capture session has to be recreated before grabbing again
+    NVFBC_CAPTURE_TYPE type; //!< Capture type of the session
+    NVFBC_BOX box; //!< Captured area of the screen
+    uint32_t width, height; //!< Frame size
+    NVFBC_BUFFER_FORMAT format; //!< Buffer format
+    bool is_setup; //!< Whether ToSys or ToGL setup was called
+    uint8_t* buffer; //!< System memory frame
+    uint32_t buffer_size; //!< Size of the system memory frame
+    uint8_t* diffmap; //!< Differential map
+    uint32_t diffmap_scale; //!< Differential map scaling factor
+    uint32_t diffmap_width, diffmap_height; //!< Differential map size
+
+    uint64_t start; //!< Time the session was created in ns
+    uint64_t frame; //!< Number of the last frame handed out
+    uint64_t grabs; //!< Number of grab calls
+    uint32_t texture; //!< Index of the last ToGL texture
+} mock_handle; //!< Mock NvFBC handle
+
+static mock_config config; //!< Mock configuration
+
+/**
+ * Return the current monotonic time
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \return
+ *   Time in ns
+ */
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Sleep until the given time
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param target
+ *   Time in ns
+ */
+static void sleep_until(uint64_t target) {
+    struct timespec ts = { .tv_sec = target / 1000000000ULL, .tv_nsec = target % 1000000000ULL };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL));
+}
+
+/**
+ * Read an integer from the environment
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param name
+ *   Name of the variable
+ * \param fallback
+ *   Value if the variable isn't set
+ *
+ * \return
+ *   Value of the variable
+ */
+static long env_int(const char* name, long fallback) {
+    const char* value = getenv(name);
+    return value && *value ? strtol(value, NULL, 0) : fallback;
+}
+
+/**
+ * Set the last error of a handle and return the status
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param handle
+ *   Mock handle
+ * \param status
+ *   Status to return
+ * \param message
+ *   Error message
+ *
+ * \return
+ *   status
+ */
+static NVFBCSTATUS fail(mock_handle* handle, NVFBCSTATUS status, const char* message) {
+    snprintf(handle->last_error, sizeof(handle->last_error), "%s", message);
+    return status;
+}
+
+/**
+ * Check that the context is bound to the calling thread
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param handle
+ *   Mock handle
+ *
+ * \return
+ *   True if the calling thread owns the context
+ */
+static bool owns_context(mock_handle* handle) {
+    pthread_mutex_lock(&handle->lock);
+    bool owned = handle->bound && pthread_equal(handle->owner, pthread_self());
+    pthread_mutex_unlock(&handle->lock);
+    return owned;
+}
+
+/**
+ * Return the position of the moving box in a frame
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param handle
+ *   Mock handle
+ * \param frame
+ *   Frame number
+ * \param x
+ *   Left edge of the box
+ * \param y
+ *   Top edge of the box
+ */
+static void box_position(mock_handle* handle, uint64_t frame, uint32_t* x, uint32_t* y) {
+    *x = (frame * 8) % (handle->width > MOCK_BOX_SIZE ? handle->width - MOCK_BOX_SIZE : 1);
+    *y = (frame * 8) % (handle->height > MOCK_BOX_SIZE ? handle->height - MOCK_BOX_SIZE : 1);
+}
+
+/**
+ * Draw part of a frame into the system memory buffer
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param handle
+ *   Mock handle
+ * \param frame
+ *   Frame number
+ * \param left
+ *   Left edge of the area
+ * \param top
+ *   Top edge of the area
+ * \param right
+ *   Right edge of the area (exclusive)
+ * \param bottom
+ *   Bottom edge of the area (exclusive)
+ */
+static void draw_area(mock_handle* handle, uint64_t frame, uint32_t left, uint32_t top, uint32_t right, uint32_t bottom) {
+    uint32_t box_x, box_y;
+    box_position(handle, frame, &box_x, &box_y);
+    right = right < handle->width ? right : handle->width;
+    bottom = bottom < handle->height ? bottom : handle->height;
+
+    size_t bpp = handle->format == NVFBC_BUFFER_FORMAT_NV12 || handle->format == NVFBC_BUFFER_FORMAT_YUV444P ? 1
+        : handle->format == NVFBC_BUFFER_FORMAT_RGB ? 3 : 4;
+    for (uint32_t y = top; y < bottom; y++) {
+        uint8_t* row = handle->buffer + (size_t) y * handle->width * bpp;
+        for (uint32_t x = left; x < right; x++) {
+            bool in_box = x >= box_x && x < box_x + MOCK_BOX_SIZE && y >= box_y && y < box_y + MOCK_BOX_SIZE;
+            memset(row + x * bpp, in_box ? 0xFF : (x ^ y) & 0x7F, bpp);
+        }
+    }
+}
+
+/**
+ * Draw a frame into the system memory buffer
+ *
+ * Every frame is a fixed gradient with a box moving along the diagonal,
+ * so the same frame number always produces the same pixels. Only the area
+ * the box left and entered is redrawn.
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param handle
+ *   Mock handle
+ * \param previous
+ *   Frame number currently in the buffer
+ * \param frame
+ *   Frame number to draw
+ */
+static void draw_frame(mock_handle* handle, uint64_t previous, uint64_t frame) {
+    uint64_t frames[2] = { previous, frame };
+    for (int i = 0; i < 2; i++) {
+        uint32_t box_x, box_y;
+        box_position(handle, frames[i], &box_x, &box_y);
+        draw_area(handle, frame, box_x, box_y, box_x + MOCK_BOX_SIZE, box_y + MOCK_BOX_SIZE);
+    }
+}
+
+/**
+ * Draw a whole frame into the system memory buffer
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param handle
+ *   Mock handle
+ * \param frame
+ *   Frame number
+ */
+static void draw_full_frame(mock_handle* handle, uint64_t frame) {
+    draw_area(handle, frame, 0, 0, handle->width, handle->height);
+
+    // neutral chroma
+    uint32_t w = handle->width, h = handle->height;
+    if (handle->format == NVFBC_BUFFER_FORMAT_NV12)
+        memset(handle->buffer + (size_t) w * h, 0x80, (size_t) w * ((h + 1) / 2));
+    else if (handle->format == NVFBC_BUFFER_FORMAT_YUV444P)
+        memset(handle->buffer + (size_t) w * h, 0x80, (size_t) w * h * 2);
+}
+
+/**
+ * Mark the blocks the moving box left and entered
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param handle
+ *   Mock handle
+ * \param previous
+ *   Previous frame number
+ * \param frame
+ *   Frame number
+ */
+static void draw_diffmap(mock_handle* handle, uint64_t previous, uint64_t frame) {
+    memset(handle->diffmap, 0, (size_t) handle->diffmap_width * handle->diffmap_height);
+    if (previous == frame)
+        return;
+
+    uint64_t frames[2] = { previous, frame };
+    for (int i = 0; i < 2; i++) {
+        uint32_t box_x, box_y;
+        box_position(handle, frames[i], &box_x, &box_y);
+        for (uint32_t y = box_y / handle->diffmap_scale; y <= (box_y + MOCK_BOX_SIZE - 1) / handle->diffmap_scale && y < handle->diffmap_height; y++)
+            for (uint32_t x = box_x / handle->diffmap_scale; x <= (box_x + MOCK_BOX_SIZE - 1) / handle->diffmap_scale && x < handle->diffmap_width; x++)
+                handle->diffmap[(size_t) y * handle->diffmap_width + x] = 1;
+    }
+}
+
+/**
+ * Allocate the differential map of a session
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param handle
+ *   Mock handle
+ * \param scale
+ *   Requested scaling factor
+ * \param size
+ *   Size of the differential map
+ *
+ * \return
+ *   Differential map
+ */
+static uint8_t* setup_diffmap(mock_handle* handle, uint32_t scale, NVFBC_SIZE* size) {
+    handle->diffmap_scale = scale < 1 ? 1 : scale;
+    handle->diffmap_width = (handle->width + handle->diffmap_scale - 1) / handle->diffmap_scale;
+    handle->diffmap_height = (handle->height + handle->diffmap_scale - 1) / handle->diffmap_scale;
+    free(handle->diffmap);
+    handle->diffmap = (uint8_t*) calloc((size_t) handle->diffmap_width * handle->diffmap_height, 1);
+    size->w = handle->diffmap_width;
+    size->h = handle->diffmap_height;
+    return handle->diffmap;
+}
+
+/**
+ * Wait for and hand out the next frame
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param handle
+ *   Mock handle
+ * \param flags
+ *   Grab flags (the ToSys and ToGL flag values are identical)
+ * \param timeout_ms
+ *   Wait timeout in ms (0 to wait forever)
+ * \param info
+ *   Frame grab info to fill (may be NULL)
+ *
+ * \return
+ *   Status of the grab
+ */
+static NVFBCSTATUS grab(mock_handle* handle, uint32_t flags, uint32_t timeout_ms, NVFBC_FRAME_GRAB_INFO* info) {
+    if (!handle->has_session || !handle->is_setup)
+        return fail(handle, NVFBC_ERR_BAD_REQUEST, "No capture session set up");
+    if (!owns_context(handle))
+        return fail(handle, NVFBC_ERR_CONTEXT, "Context is not bound to the calling thread");
+    if (handle->must_recreate)
+        return fail(handle, NVFBC_ERR_MUST_RECREATE, "Capture session must be recreated");
+
+    // injected failures
+    handle->grabs++;
+    if (config.fail_every && handle->grabs % config.fail_every == 0) {
+        if (config.fail_status == NVFBC_ERR_MUST_RECREATE)
+            handle->must_recreate = true;
+        return fail(handle, config.fail_status, "Injected failure");
+    }
+
+    uint64_t now = now_ns();
+    uint64_t previous = handle->frame;
+    uint64_t frame = previous;
+    if (config.new_frames[0]) {
+        // new frames follow the pattern, waiting never blocks
+        size_t length = strlen(config.new_frames);
+        if (config.new_frames[(handle->grabs - 1) % length] == '1')
+            frame++;
+    } else {
+        // new frames follow the frame rate
+        uint64_t ready = (now - handle->start) / config.interval + 1;
+        bool wait = !(flags & NVFBC_TOSYS_GRAB_FLAGS_NOWAIT)
+            && !((flags & NVFBC_TOSYS_GRAB_FLAGS_NOWAIT_IF_NEW_FRAME_READY) && ready > previous);
+        if (wait) {
+            uint64_t next = handle->start + ready * config.interval;
+            if (timeout_ms && next > now + timeout_ms * 1000000ULL) {
+                sleep_until(now + timeout_ms * 1000000ULL);
+            } else {
+                sleep_until(next);
+                ready++;
+            }
+        }
+        frame = ready > previous ? ready : previous;
+    }
+
+    // simulated driver time
+    if (config.latency)
+        sleep_until(now_ns() + config.latency);
+
+    // only new frames (or forced refreshes) touch the buffers
+    if (handle->buffer && (frame != previous || (flags & NVFBC_TOSYS_GRAB_FLAGS_FORCE_REFRESH)))
+        draw_frame(handle, previous, frame);
+    if (handle->diffmap)
+        draw_diffmap(handle, previous, frame);
+    handle->frame = frame;
+
+    if (info) {
+        info->dwWidth = handle->width;
+        info->dwHeight = handle->height;
+        info->dwByteSize = handle->buffer_size;
+        info->dwCurrentFrame = (uint32_t) frame;
+        info->bIsNewFrame = frame != previous;
+        info->ulTimestampUs = (handle->start + frame * config.interval) / 1000;
+        info->dwMissedFrames = frame > previous + 1 ? (uint32_t) (frame - previous - 1) : 0;
+        info->bRequiredPostProcessing = handle->format != NVFBC_BUFFER_FORMAT_BGRA;
+        info->bDirectCapture = NVFBC_FALSE;
+    }
+    return NVFBC_SUCCESS;
+}
+
+// (the entry points below behave as documented in NvFBC.h)
+
+static const char* NVFBCAPI mock_get_last_error_str(const NVFBC_SESSION_HANDLE session) {
+    return session ? ((mock_handle*) (uintptr_t) session)->last_error : "Invalid handle";
+}
+
+static NVFBCSTATUS NVFBCAPI mock_create_handle(NVFBC_SESSION_HANDLE* session, NVFBC_CREATE_HANDLE_PARAMS* params) {
+    if (!session || !params)
+        return NVFBC_ERR_INVALID_PTR;
+
+    mock_handle* handle = (mock_handle*) calloc(1, sizeof(mock_handle));
+    pthread_mutex_init(&handle->lock, NULL);
+    handle->bound = true;
+    handle->owner = pthread_self();
+    *session = (NVFBC_SESSION_HANDLE) (uintptr_t) handle;
+    return NVFBC_SUCCESS;
+}
+
+static NVFBCSTATUS NVFBCAPI mock_destroy_handle(const NVFBC_SESSION_HANDLE session, NVFBC_DESTROY_HANDLE_PARAMS* params) {
+    mock_handle* handle = (mock_handle*) (uintptr_t) session;
+    if (!handle)
+        return NVFBC_ERR_INVALID_HANDLE;
+
+    free(handle->buffer);
+    free(handle->diffmap);
+    pthread_mutex_destroy(&handle->lock);
+    free(handle);
+    return NVFBC_SUCCESS;
+}
+
+static NVFBCSTATUS NVFBCAPI mock_get_status(const NVFBC_SESSION_HANDLE session, NVFBC_GET_STATUS_PARAMS* params) {
+    mock_handle* handle = (mock_handle*) (uintptr_t) session;
+    if (!handle)
+        return NVFBC_ERR_INVALID_HANDLE;
+
+    params->bIsCapturePossible = NVFBC_TRUE;
+    params->bCurrentlyCapturing = handle->has_session;
+    params->bCanCreateNow = !handle->has_session;
+    params->screenSize = (NVFBC_SIZE) { config.width, config.height };
+    params->bXRandRAvailable = NVFBC_TRUE;
+    params->dwOutputNum = 1;
+    params->outputs[0].dwId = 1;
+    snprintf(params->outputs[0].name, NVFBC_OUTPUT_NAME_LEN, "MOCK-0");
+    params->outputs[0].trackedBox = (NVFBC_BOX) { 0, 0, config.width, config.height };
+    params->dwNvFBCVersion = NVFBC_VERSION;
+    params->bInModeset = NVFBC_FALSE;
+    return NVFBC_SUCCESS;
+}
+
+static NVFBCSTATUS NVFBCAPI mock_create_capture_session(const NVFBC_SESSION_HANDLE session, NVFBC_CREATE_CAPTURE_SESSION_PARAMS* params) {
+    mock_handle* handle = (mock_handle*) (uintptr_t) session;
+    if (!handle)
+        return NVFBC_ERR_INVALID_HANDLE;
+    if (handle->has_session)
+        return fail(handle, NVFBC_ERR_BAD_REQUEST, "Capture session already exists");
+    if (params->eCaptureType == NVFBC_CAPTURE_SHARED_CUDA)
+        return fail(handle, NVFBC_ERR_UNSUPPORTED, "CUDA capture is not mocked");
+
+    // captured area, then the frame size it is scaled to
+    handle->box = (NVFBC_BOX) { 0, 0, config.width, config.height };
+    if (params->captureBox.w && params->captureBox.h)
+        handle->box = params->captureBox;
+    handle->width = params->frameSize.w ? params->frameSize.w : handle->box.w;
+    handle->height = params->frameSize.h ? params->frameSize.h : handle->box.h;
+
+    handle->type = params->eCaptureType;
+    handle->has_session = true;
+    handle->must_recreate = false;
+    handle->is_setup = false;
+    handle->start = now_ns();
+    handle->frame = 0;
+    handle->grabs = 0;
+    handle->texture = NVFBC_TOGL_TEXTURES_MAX - 1;
+    return NVFBC_SUCCESS;
+}
+
+static NVFBCSTATUS NVFBCAPI mock_destroy_capture_session(const NVFBC_SESSION_HANDLE session, NVFBC_DESTROY_CAPTURE_SESSION_PARAMS* params) {
+    mock_handle* handle = (mock_handle*) (uintptr_t) session;
+    if (!handle)
+        return NVFBC_ERR_INVALID_HANDLE;
+    if (!handle->has_session)
+        return fail(handle, NVFBC_ERR_BAD_REQUEST, "No capture session");
+
+    handle->has_session = false;
+    handle->is_setup = false;
+    return NVFBC_SUCCESS;
+}
+
+static NVFBCSTATUS NVFBCAPI mock_bind_context(const NVFBC_SESSION_HANDLE session, NVFBC_BIND_CONTEXT_PARAMS* params) {
+    mock_handle* handle = (mock_handle*) (uintptr_t) session;
+    if (!handle)
+        return NVFBC_ERR_INVALID_HANDLE;
+
+    pthread_mutex_lock(&handle->lock);
+    bool busy = handle->bound && !pthread_equal(handle->owner, pthread_self());
+    if (!busy) {
+        handle->bound = true;
+        handle->owner = pthread_self();
+    }
+    pthread_mutex_unlock(&handle->lock);
+    return busy ? fail(handle, NVFBC_ERR_CONTEXT, "Context is bound to another thread") : NVFBC_SUCCESS;
+}
+
+static NVFBCSTATUS NVFBCAPI mock_release_context(const NVFBC_SESSION_HANDLE session, NVFBC_RELEASE_CONTEXT_PARAMS* params) {
+    mock_handle* handle = (mock_handle*) (uintptr_t) session;
+    if (!handle)
+        return NVFBC_ERR_INVALID_HANDLE;
+
+    pthread_mutex_lock(&handle->lock);
+    bool owned = handle->bound && pthread_equal(handle->owner, pthread_self());
+    if (owned)
+        handle->bound = false;
+    pthread_mutex_unlock(&handle->lock);
+    return owned ? NVFBC_SUCCESS : fail(handle, NVFBC_ERR_CONTEXT, "Context is not bound to the calling thread");
+}
+
+static NVFBCSTATUS NVFBCAPI mock_tosys_setup(const NVFBC_SESSION_HANDLE session, NVFBC_TOSYS_SETUP_PARAMS* params) {
+    mock_handle* handle = (mock_handle*) (uintptr_t) session;
+    if (!handle)
+        return NVFBC_ERR_INVALID_HANDLE;
+    if (!handle->has_session || handle->type != NVFBC_CAPTURE_TO_SYS)
+        return fail(handle, NVFBC_ERR_BAD_REQUEST, "No system memory capture session");
+    if (!params->ppBuffer)
+        return NVFBC_ERR_INVALID_PTR;
+    if (params->bWithDiffMap && (params->eBufferFormat == NVFBC_BUFFER_FORMAT_NV12 || params->eBufferFormat == NVFBC_BUFFER_FORMAT_YUV444P))
+        return fail(handle, NVFBC_ERR_INVALID_PARAM, "Differential maps don't support YUV formats");
+
+    // allocate the frame
+    size_t pixels = (size_t) handle->width * handle->height;
+    handle->format = params->eBufferFormat;
+    switch (handle->format) {
+        case NVFBC_BUFFER_FORMAT_NV12: handle->buffer_size = pixels + (size_t) handle->width * ((handle->height + 1) / 2); break;
+        case NVFBC_BUFFER_FORMAT_YUV444P: case NVFBC_BUFFER_FORMAT_RGB: handle->buffer_size = pixels * 3; break;
+        default: handle->buffer_size = pixels * 4; break;
+    }
+    free(handle->buffer);
+    handle->buffer = (uint8_t*) malloc(handle->buffer_size);
+    draw_full_frame(handle, handle->frame);
+    *params->ppBuffer = handle->buffer;
+
+    if (params->bWithDiffMap) {
+        if (!params->ppDiffMap)
+            return NVFBC_ERR_INVALID_PTR;
+        *params->ppDiffMap = setup_diffmap(handle, params->dwDiffMapScalingFactor, &params->diffMapSize);
+    }
+
+    handle->is_setup = true;
+    return NVFBC_SUCCESS;
+}
+
+static NVFBCSTATUS NVFBCAPI mock_tosys_grab_frame(const NVFBC_SESSION_HANDLE session, NVFBC_TOSYS_GRAB_FRAME_PARAMS* params) {
+    mock_handle* handle = (mock_handle*) (uintptr_t) session;
+    if (!handle)
+        return NVFBC_ERR_INVALID_HANDLE;
+    if (handle->type != NVFBC_CAPTURE_TO_SYS)
+        return fail(handle, NVFBC_ERR_BAD_REQUEST, "Not a system memory capture session");
+
+    return grab(handle, params->dwFlags, params->dwTimeoutMs, params->pFrameGrabInfo);
+}
+
+static NVFBCSTATUS NVFBCAPI mock_tocuda_setup(const NVFBC_SESSION_HANDLE session, NVFBC_TOCUDA_SETUP_PARAMS* params) {
+    return NVFBC_ERR_UNSUPPORTED;
+}
+
+static NVFBCSTATUS NVFBCAPI mock_tocuda_grab_frame(const NVFBC_SESSION_HANDLE session, NVFBC_TOCUDA_GRAB_FRAME_PARAMS* params) {
+    return NVFBC_ERR_UNSUPPORTED;
+}
+
+static NVFBCSTATUS NVFBCAPI mock_togl_setup(const NVFBC_SESSION_HANDLE session, NVFBC_TOGL_SETUP_PARAMS* params) {
+    mock_handle* handle = (mock_handle*) (uintptr_t) session;
+    if (!handle)
+        return NVFBC_ERR_INVALID_HANDLE;
+    if (!handle->has_session || handle->type != NVFBC_CAPTURE_TO_GL)
+        return fail(handle, NVFBC_ERR_BAD_REQUEST, "No GL capture session");
+
+    // there is no GL behind the mock, so the textures are only names
+    handle->format = params->eBufferFormat;
+    handle->buffer_size = handle->width * handle->height * 4;
+    for (int i = 0; i < NVFBC_TOGL_TEXTURES_MAX; i++)
+        params->dwTextures[i] = MOCK_TEXTURE_BASE + i;
+    params->dwTexTarget = 0x0DE1; // GL_TEXTURE_2D
+    params->dwTexFormat = 0x80E1; // GL_BGRA
+    params->dwTexType = 0x1401; // GL_UNSIGNED_BYTE
+
+    if (params->bWithDiffMap) {
+        if (!params->ppDiffMap)
+            return NVFBC_ERR_INVALID_PTR;
+        *params->ppDiffMap = setup_diffmap(handle, params->dwDiffMapScalingFactor, &params->diffMapSize);
+    }
+
+    handle->is_setup = true;
+    return NVFBC_SUCCESS;
+}
+
+static NVFBCSTATUS NVFBCAPI mock_togl_grab_frame(const NVFBC_SESSION_HANDLE session, NVFBC_TOGL_GRAB_FRAME_PARAMS* params) {
+    mock_handle* handle = (mock_handle*) (uintptr_t) session;
+    if (!handle)
+        return NVFBC_ERR_INVALID_HANDLE;
+    if (handle->type != NVFBC_CAPTURE_TO_GL)
+        return fail(handle, NVFBC_ERR_BAD_REQUEST, "Not a GL capture session");
+
+    uint64_t previous = handle->frame;
+    NVFBCSTATUS status = grab(handle, params->dwFlags, params->dwTimeoutMs, params->pFrameGrabInfo);
+    if (status)
+        return status;
+
+    // new frames land in the other texture
+    if (handle->frame != previous)
+        handle->texture = (handle->texture + 1) % NVFBC_TOGL_TEXTURES_MAX;
+    params->dwTextureIndex = handle->texture;
+    return NVFBC_SUCCESS;
+}
+
+NVFBCSTATUS NVFBCAPI NvFBCCreateInstance(NVFBC_API_FUNCTION_LIST* list) {
+    if (!list)
+        return NVFBC_ERR_INVALID_PTR;
+    if (list->dwVersion != NVFBC_VERSION)
+        return NVFBC_ERR_API_VERSION;
+
+    // read the configuration
+    const char* size = getenv("NVFBC_MOCK_SIZE");
+    if (!size || sscanf(size, "%ux%u", &config.width, &config.height) != 2 || !config.width || !config.height) {
+        config.width = 1920;
+        config.height = 1080;
+    }
+    long fps = env_int("NVFBC_MOCK_FPS", 60);
+    config.interval = 1000000000ULL / (fps > 0 ? fps : 60);
+    config.latency = env_int("NVFBC_MOCK_LATENCY_US", 0) * 1000ULL;
+    const char* new_frames = getenv("NVFBC_MOCK_NEW_FRAMES");
+    snprintf(config.new_frames, sizeof(config.new_frames), "%s", new_frames ? new_frames : "");
+    config.fail_every = env_int("NVFBC_MOCK_FAIL_EVERY", 0);
+    config.fail_status = env_int("NVFBC_MOCK_FAIL_STATUS", NVFBC_ERR_MUST_RECREATE);
+
+    // fill the function list
+    list->nvFBCGetLastErrorStr = mock_get_last_error_str;
+    list->nvFBCCreateHandle = mock_create_handle;
+    list->nvFBCDestroyHandle = mock_destroy_handle;
+    list->nvFBCGetStatus = mock_get_status;
+    list->nvFBCCreateCaptureSession = mock_create_capture_session;
+    list->nvFBCDestroyCaptureSession = mock_destroy_capture_session;
+    list->nvFBCToSysSetUp = mock_tosys_setup;
+    list->nvFBCToSysGrabFrame = mock_tosys_grab_frame;
+    list->nvFBCToCudaSetUp = mock_tocuda_setup;
+    list->nvFBCToCudaGrabFrame = mock_tocuda_grab_frame;
+    list->nvFBCBindContext = mock_bind_context;
+    list->nvFBCReleaseContext = mock_release_context;
+    list->nvFBCToGLSetUp = mock_togl_setup;
+    list->nvFBCToGLGrabFrame = mock_togl_grab_frame;
+    return NVFBC_SUCCESS;
+}
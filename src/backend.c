@@ -0,0 +1,56 @@
+#include "backend.h"
+#include "layer.h"
+
+#include <obs/obs-module.h>
+#include <dlfcn.h>
+#include <string.h>
+
+/// Backends ordered by preference
+static const capture_backend* backends[] = {
+    &togl_backend,
+    &tosys_backend,
+    &cpu_backend
+};
+
+static NvFBCCustomState layer_state; //!< State the Vulkan layer records into (unused with the preload hooks)
+
+void* backend_hooks() {
+    static bool looked_up = false;
+    static void* hooks = NULL;
+    if (!looked_up) {
+        hooks = dlsym(RTLD_DEFAULT, "gstate");
+        if (!hooks && layer_start(&layer_state))
+            hooks = &layer_state;
+        looked_up = true;
+
+        // (NvFBC's system memory capture needs the GL the stubs replace, for every session in the process)
+        if (hooks)
+            blog(LOG_INFO, "NvFBC's GLX calls are stubbed for the %s, system memory capture (ToSys) is disabled",
+                hooks == &layer_state ? "Vulkan layer" : "preload hooks");
+    }
+    return hooks;
+}
+
+const capture_backend* backend_get(int index) {
+    if (index < 0 || index >= (int) (sizeof(backends) / sizeof(backends[0])))
+        return NULL;
+    return backends[index];
+}
+
+const capture_backend* backend_find(const char* id, uint32_t required) {
+    const capture_backend* fallback = NULL;
+    for (int i = 0; backend_get(i); i++) {
+        const capture_backend* backend = backend_get(i);
+        if ((backend->capabilities() & required) != required)
+            continue;
+
+        if (!id || !strcmp(id, "auto") || !strcmp(id, backend->id))
+            return backend;
+        if (!fallback)
+            fallback = backend;
+    }
+
+    if (fallback)
+        blog(LOG_WARNING, "Capture backend %s is not usable, falling back to %s", id, fallback->name);
+    return fallback;
+}
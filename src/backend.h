@@ -0,0 +1,97 @@
+#pragma once
+
+#include "source.h"
+
+#include <obs/obs-module.h>
+
+#define BACKEND_CAP_TEXTURE (1 << 0) //!< Frames are exported into the source's GL textures
+#define BACKEND_CAP_SYSTEM_MEMORY (1 << 1) //!< Frames are grabbed into system memory
+#define BACKEND_CAP_YUV (1 << 2) //!< Frames can be delivered as NV12 or I444
+#define BACKEND_CAP_DIFFMAP (1 << 3) //!< Changed regions can be tracked
+
+typedef struct {
+    int texture; //!< Index of the texture holding the frame (texture backends only)
+    bool is_new; //!< Whether the grab returned a frame that wasn't captured before
+    uint32_t number; //!< Incremental id of the frame
+    uint64_t timestamp_us; //!< Time in us at which the frame was produced
+    const uint8_t* diffmap; //!< Differential map, one byte per block, non-zero if it changed (valid until the next grab)
+    float changed_area; //!< Fraction of the frame that changed (1 without diffmaps)
+    uint8_t* data; //!< Frame in system memory (system memory backends only, valid until the next grab)
+    uint32_t linesize; //!< Bytes per row of data (of the first plane for planar formats)
+    uint32_t width, height; //!< Size of the grabbed frame (NvFBC picks it if the frame size is 0)
+    int status; //!< Backend status of a failed grab (0 if the grab wasn't attempted)
+    bool lost; //!< Whether a failed grab lost the session, which then has to be rebuilt
+} frame_info; //!< Description of a grabbed frame
+
+typedef struct {
+    uint64_t grabs; //!< Number of successful grabs
+    uint64_t new_frames; //!< Number of grabs that returned a new frame
+    uint64_t failures; //!< Number of failed grabs
+    uint64_t bytes; //!< Bytes of frame data written to system memory
+} backend_stats; //!< Statistics kept by a capture backend
+
+typedef struct {
+    const char* id; //!< Identifier stored in the source settings
+    const char* name; //!< Name shown in the properties window
+    uint32_t (*capabilities)(void); //!< Capabilities usable in this process (0 if the backend can't run)
+    int texture_count; //!< Number of textures the backend captures into, one after the other (texture backends only)
+    void (*prepare)(capture_params* params); //!< Fill in what the session needs from the graphics context, before start() runs on another thread (texture backends only, optional, graphics thread)
+    void (*start)(capture_params* params); //!< Start capturing, the session stays bound to the calling thread
+    gs_texture_t* (*wrap_buffer)(capture_params* params, int index); //!< Create a texture sharing a capture buffer, NULL to fall back to export_textures (texture backends only, optional, graphics thread)
+    bool (*export_textures)(capture_params* params); //!< Back params->textures with the capture buffers (texture backends only, graphics thread)
+    bool (*grab)(capture_params* params, frame_info* frame); //!< Grab a frame, returns false on failure (without logging it)
+    void (*release)(capture_params* params); //!< Give up the session on the calling thread
+    void (*sampled)(capture_params* params, int texture); //!< Mark a texture as read by everything drawn so far, the next grab into it waits for those reads (texture backends only, optional, graphics thread, once per OBS frame)
+    void (*get_stats)(capture_params* params, backend_stats* stats); //!< Read the statistics since start
+    void (*stop)(capture_params* params); //!< Stop capturing
+} capture_backend; //!< Capture backend
+
+extern const capture_backend togl_backend; //!< NvFBC ToGL capture into the source's textures (needs the preload hooks or the Vulkan layer)
+extern const capture_backend tosys_backend; //!< NvFBC ToSys capture into system memory (needs NvFBC's own GL, so neither the preload hooks nor the Vulkan layer)
+extern const capture_backend cpu_backend; //!< Test pattern drawn on the CPU, for comparisons without NvFBC
+
+/**
+ * Return the state of the preload hooks or the Vulkan layer
+ *
+ * Without the preload hooks, the first call sets up the Vulkan layer if it
+ * is installed, so call it before NvFBC is used.
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \return
+ *   Hook state, or NULL if neither the hooks are preloaded nor the layer is installed
+ */
+void* backend_hooks();
+
+/**
+ * Return a backend by index
+ *
+ * Backends are ordered by preference, faster ones first.
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param index
+ *   Index of the backend
+ *
+ * \return
+ *   Backend, or NULL if the index is out of range
+ */
+const capture_backend* backend_get(int index);
+
+/**
+ * Find a usable backend
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param id
+ *   Identifier of the preferred backend ("auto" or NULL for the fastest one)
+ * \param required
+ *   Capabilities the backend must have
+ *
+ * \return
+ *   The preferred backend if it is usable, otherwise the fastest usable one, or NULL if there is none
+ */
+const capture_backend* backend_find(const char* id, uint32_t required);
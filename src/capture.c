@@ -0,0 +1,1022 @@
+#include "capture.h"
+
+#include <obs/util/platform.h>
+#include <obs/util/threading.h>
+#include <string.h>
+#include <inttypes.h>
+
+#define RECOVERY_BACKOFF_MIN_NS 250000000ULL //!< Delay before the second attempt to rebuild a lost session
+#define RECOVERY_BACKOFF_MAX_NS 8000000000ULL //!< Longest delay between two attempts to rebuild a lost session
+#define FAILURE_LOG_INTERVAL_NS 5000000000ULL //!< Failed grabs are logged at most once per interval
+
+static fbc_capture* captures = NULL; //!< Texture captures that can be shared
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER; //!< Lock protecting the registry and reference counts
+
+static pthread_mutex_t reaper_lock = PTHREAD_MUTEX_INITIALIZER; //!< Lock protecting the reaper count
+static pthread_cond_t reaper_done = PTHREAD_COND_INITIALIZER; //!< Signaled whenever a reaper finishes
+static int reapers = 0; //!< Number of captures destroyed after their startup thread finishes
+
+/**
+ * Map an NvFBC timestamp onto the os_gettime_ns() clock
+ *
+ * The offset between both clocks is the smallest difference seen between a
+ * grab returning and the display server starting to render the frame, which
+ * converges on the true offset no matter which clock NvFBC uses.
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param capture
+ *   Capture
+ * \param timestamp_us
+ *   NvFBC timestamp in us
+ *
+ * \return
+ *   Capture time in ns
+ */
+static uint64_t map_timestamp(fbc_capture* capture, uint64_t timestamp_us) {
+    int64_t offset = (int64_t) (os_gettime_ns() - timestamp_us * 1000);
+    if (!capture->has_clock_offset || offset < capture->clock_offset) {
+        capture->clock_offset = offset;
+        capture->has_clock_offset = true;
+    }
+
+    return timestamp_us * 1000 + capture->clock_offset;
+}
+
+/**
+ * Record how much of a new frame changed
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param capture
+ *   Capture
+ * \param changed_area
+ *   Fraction of the frame that changed
+ */
+static void record_changes(fbc_capture* capture, float changed_area) {
+    if (!capture->config.params.with_diffmap)
+        return;
+
+    capture->stats.changed_area = changed_area;
+    capture->stats.changed_total += changed_area;
+    capture->stats.changed_frames++;
+    if (changed_area == 0.0f)
+        capture->stats.idle_frames++;
+}
+
+/**
+ * Log a failed grab, at most once per FAILURE_LOG_INTERVAL_NS
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param capture
+ *   Capture
+ * \param frame
+ *   Failed grab
+ */
+static void log_grab_failure(fbc_capture* capture, const frame_info* frame) {
+    atomic_fetch_add_explicit(&capture->stats.failed_grabs, 1, memory_order_relaxed);
+
+    uint64_t now = os_gettime_ns();
+    if (now < capture->log_at) {
+        capture->suppressed_logs++;
+        return;
+    }
+
+    const char* name = capture->config.backend->name;
+    if (capture->suppressed_logs)
+        blog(LOG_WARNING, "%s failed to grab a frame: %d (%" PRIu64 " more failures since the last message)", name, frame->status, capture->suppressed_logs);
+    else
+        blog(LOG_WARNING, "%s failed to grab a frame: %d", name, frame->status);
+    capture->log_at = now + FAILURE_LOG_INTERVAL_NS;
+    capture->suppressed_logs = 0;
+}
+
+/**
+ * Mark the session as lost and schedule the next attempt to rebuild it
+ *
+ * The first attempt is made right away, every further one waits twice as
+ * long as the one before, up to RECOVERY_BACKOFF_MAX_NS.
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param capture
+ *   Capture
+ */
+static void lose_session(fbc_capture* capture) {
+    // (the graphics thread and the proc handlers read the recovery state while it is written)
+    uint64_t now = os_gettime_ns();
+    uint64_t backoff = atomic_load(&capture->backoff);
+    if (!atomic_load(&capture->lost_at)) {
+        atomic_store(&capture->lost_at, now);
+        blog(LOG_WARNING, "Lost the %s session, rebuilding it", capture->config.backend->name);
+    } else {
+        blog(LOG_WARNING, "Rebuilt %s session didn't work, trying again in %.2f s", capture->config.backend->name, backoff / 1000000000.0);
+    }
+
+    atomic_store(&capture->retry_at, now + backoff);
+    atomic_store(&capture->backoff, backoff * 2 > RECOVERY_BACKOFF_MAX_NS ? RECOVERY_BACKOFF_MAX_NS
+        : backoff ? backoff * 2 : RECOVERY_BACKOFF_MIN_NS);
+    atomic_store(&capture->state, CAPTURE_LOST);
+}
+
+/**
+ * Finish a recovery once the rebuilt session delivered a frame
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param capture
+ *   Capture
+ */
+static void finish_recovery(fbc_capture* capture) {
+    uint64_t lost_at = atomic_load(&capture->lost_at);
+    if (!lost_at || atomic_load(&capture->state) != CAPTURE_RUNNING)
+        return;
+
+    capture_stats* stats = &capture->stats;
+    uint64_t duration = os_gettime_ns() - lost_at;
+    atomic_fetch_add(&stats->recoveries, 1);
+    atomic_store(&stats->recovery_last, duration);
+    atomic_fetch_add(&stats->recovery_total, duration);
+    if (duration > atomic_load(&stats->recovery_max))
+        atomic_store(&stats->recovery_max, duration);
+
+    atomic_store(&capture->lost_at, 0);
+    atomic_store(&capture->backoff, 0);
+    blog(LOG_INFO, "Recovered the %s session after %.1f ms", capture->config.backend->name, duration / 1000000.0);
+}
+
+/**
+ * Hand the last grabbed frame to OBS as async video
+ *
+ * OBS copies the frame into its own (reused) frame cache before returning,
+ * so NvFBC's buffer can be handed over directly.
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param capture
+ *   System memory capture
+ * \param grabbed
+ *   Grabbed frame
+ */
+static void output_frame(fbc_capture* capture, const frame_info* grabbed) {
+    capture_params* params = &capture->config.params;
+    record_changes(capture, grabbed->changed_area);
+    finish_recovery(capture);
+
+    struct obs_source_frame2 frame = {
+        .data = { grabbed->data },
+        .linesize = { grabbed->linesize },
+        .width = grabbed->width,
+        .height = grabbed->height,
+        .timestamp = capture->config.use_timestamps ? map_timestamp(capture, grabbed->timestamp_us) : os_gettime_ns(),
+        .format = VIDEO_FORMAT_BGRA,
+        .range = VIDEO_RANGE_FULL
+    };
+
+    // NvFBC stores the planes back to back and converts with BT.709 video range weights
+    size_t plane_size = (size_t) grabbed->linesize * grabbed->height;
+    switch (params->format) {
+        case PIXEL_FORMAT_NV12:
+            frame.format = VIDEO_FORMAT_NV12;
+            frame.data[1] = grabbed->data + plane_size;
+            frame.linesize[1] = grabbed->linesize;
+            break;
+        case PIXEL_FORMAT_I444:
+            frame.format = VIDEO_FORMAT_I444;
+            frame.data[1] = grabbed->data + plane_size;
+            frame.data[2] = grabbed->data + plane_size * 2;
+            frame.linesize[1] = frame.linesize[2] = grabbed->linesize;
+            break;
+        default:
+            break;
+    }
+    if (frame.format != VIDEO_FORMAT_BGRA) {
+        frame.range = VIDEO_RANGE_PARTIAL;
+        video_format_get_parameters_for_format(VIDEO_CS_709, frame.range, frame.format, frame.color_matrix, frame.color_range_min, frame.color_range_max);
+    }
+
+    uint64_t start = timing_begin(STAGE_OUTPUT);
+    obs_source_output_video2(capture->output, &frame);
+    timing_end(&capture->timings, STAGE_OUTPUT, start);
+}
+
+/**
+ * Switch to a new frame and measure its latency
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param capture
+ *   Texture capture
+ * \param slot
+ *   Frame to show
+ */
+static void show_frame(fbc_capture* capture, const frame_slot* slot) {
+    capture->current_texture = slot->texture;
+    record_changes(capture, slot->changed_area);
+    finish_recovery(capture);
+
+    if (!capture->config.use_timestamps)
+        return;
+
+    capture_stats* stats = &capture->stats;
+    uint64_t now = os_gettime_ns();
+    uint64_t latency = now > slot->timestamp ? now - slot->timestamp : 0;
+    stats->latency_last = latency;
+    stats->latency_total += latency;
+    stats->latency_frames++;
+    if (latency > stats->latency_max)
+        stats->latency_max = latency;
+}
+
+/**
+ * Log the statistics of the capture
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param capture
+ *   Capture
+ */
+static void log_stats(fbc_capture* capture) {
+    capture_stats* stats = &capture->stats;
+
+    // report how often renders could reuse the last grab (system memory captures aren't rendered)
+    if (!capture->config.async) {
+        blog(LOG_INFO, "Captured %" PRIu64 " frames for %" PRIu64 " renders (%" PRIu64 " duplicate renders)",
+            atomic_load(&stats->grabs), stats->renders, stats->duplicate_renders);
+    }
+    if (stats->latency_frames)
+        blog(LOG_INFO, "Capture-to-render latency: %.2f ms average, %.2f ms max",
+            stats->latency_total / (double) stats->latency_frames / 1000000.0, stats->latency_max / 1000000.0);
+    if (stats->changed_frames)
+        blog(LOG_INFO, "Changed area: %.1f%% average, %" PRIu64 " of %" PRIu64 " frames unchanged",
+            100.0 * stats->changed_total / stats->changed_frames, stats->idle_frames, stats->changed_frames);
+
+    uint64_t recoveries = atomic_load(&stats->recoveries);
+    if (atomic_load(&stats->recovery_attempts))
+        blog(LOG_INFO, "Recovered %" PRIu64 " times from a lost session with %" PRIu64 " new sessions: %.1f ms average, %.1f ms max",
+            recoveries, atomic_load(&stats->recovery_attempts),
+            recoveries ? atomic_load(&stats->recovery_total) / (double) recoveries / 1000000.0 : 0.0, atomic_load(&stats->recovery_max) / 1000000.0);
+
+    backend_stats backend;
+    capture->config.backend->get_stats(&capture->config.params, &backend);
+    blog(LOG_INFO, "%s: %" PRIu64 " grabs (%" PRIu64 " new frames, %" PRIu64 " failed), %.1f MiB copied to system memory",
+        capture->config.backend->name, backend.grabs, backend.new_frames, backend.failures, backend.bytes / 1048576.0);
+}
+
+/**
+ * Start the session of a capture
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param capture
+ *   Capture
+ */
+static void start_session(fbc_capture* capture) {
+    blog(LOG_INFO, "Capturing with %s", capture->config.backend->name);
+    uint64_t start = timing_begin(STAGE_SETUP);
+    capture->config.backend->start(&capture->config.params);
+    timing_end(&capture->timings, STAGE_SETUP, start);
+}
+
+/**
+ * Pick up in-place changes queued by capture_reconfigure()
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param capture
+ *   System memory capture
+ */
+static void apply_pending(fbc_capture* capture) {
+    pthread_mutex_lock(&capture->pending_lock);
+    capture->config.params.mode = capture->pending.params.mode;
+    capture->config.use_timestamps = capture->pending.use_timestamps;
+    atomic_store(&capture->has_pending, false);
+    pthread_mutex_unlock(&capture->pending_lock);
+}
+
+/**
+ * Rebuild a lost system memory session on the capture thread
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param capture
+ *   System memory capture
+ *
+ * \return
+ *   True if a new session was built, false if the thread was told to stop while waiting
+ */
+static bool rebuild_session(fbc_capture* capture) {
+    while (os_gettime_ns() < atomic_load(&capture->retry_at)) {
+        if (!atomic_load(&capture->thread_running))
+            return false;
+        os_sleep_ms(10);
+    }
+
+    capture->config.backend->stop(&capture->config.params);
+    atomic_fetch_add(&capture->stats.recovery_attempts, 1);
+    start_session(capture);
+    atomic_store(&capture->state, CAPTURE_RUNNING);
+    return true;
+}
+
+/**
+ * Capture frames until told to stop
+ *
+ * System memory sessions live entirely on this thread, including their
+ * recovery. Texture captures stop once their session is lost.
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param data
+ *   Capture
+ */
+static void* capture_thread(void* data) {
+    fbc_capture* capture = (fbc_capture*) data;
+    os_set_thread_name("nvfbc-capture");
+
+    // build the system memory session, then take over from the capture it replaces
+    if (capture->config.async) {
+        start_session(capture);
+        atomic_store(&capture->state, CAPTURE_RUNNING);
+        if (capture->retired) {
+            capture_release(capture->retired);
+            capture->retired = NULL;
+        }
+    }
+
+    // non-waiting grabs have to be paced manually
+    struct obs_video_info ovi;
+    uint64_t interval = 16666667;
+    if (obs_get_video_info(&ovi) && ovi.fps_num)
+        interval = 1000000000ULL * ovi.fps_den / ovi.fps_num;
+
+    const capture_backend* backend = capture->config.backend;
+    capture_params* params = &capture->config.params;
+    uint64_t next = os_gettime_ns();
+    frame_info frame = { 0 };
+    while (atomic_load_explicit(&capture->thread_running, memory_order_relaxed)) {
+        if (atomic_load_explicit(&capture->has_pending, memory_order_acquire))
+            apply_pending(capture);
+
+        // wait for render() to make room, so a grab never lands in a buffer that is still queued or the one render() shows
+        // (NvFBC's ToGL capture only has two buffers, so it runs at most one frame ahead)
+        uint64_t head = atomic_load_explicit(&capture->ring_head, memory_order_relaxed);
+        uint64_t queued = head - atomic_load_explicit(&capture->ring_tail, memory_order_acquire);
+        if (!capture->config.async && queued + 1 >= (uint64_t) backend->texture_count) {
+            os_sleep_ms(1);
+            continue;
+        }
+
+        // only queue (or output) frames that weren't seen yet
+        uint64_t start = timing_begin(STAGE_GRAB);
+        bool captured = backend->grab(params, &frame);
+        timing_end(&capture->timings, STAGE_GRAB, start);
+        if (captured) {
+            atomic_fetch_add_explicit(&capture->stats.grabs, 1, memory_order_relaxed);
+            if (frame.is_new && capture->config.async) {
+                output_frame(capture, &frame);
+            } else if (frame.is_new) {
+                frame_slot* slot = &capture->ring[head % MAX_BUFFERS];
+                slot->texture = frame.texture;
+                slot->timestamp = capture->config.use_timestamps ? map_timestamp(capture, frame.timestamp_us) : 0;
+                slot->changed_area = frame.changed_area;
+                atomic_store_explicit(&capture->ring_head, head + 1, memory_order_release);
+            }
+        } else {
+            log_grab_failure(capture, &frame);
+
+            // (texture sessions are rebuilt by the graphics thread, which owns their textures)
+            if (frame.lost) {
+                lose_session(capture);
+                if (!capture->config.async || !rebuild_session(capture))
+                    break;
+                next = os_gettime_ns();
+                continue;
+            }
+        }
+
+        // sleep until the next frame if the grab didn't wait (or failed)
+        next += interval;
+        if (params->mode == GRAB_MODE_NOWAIT || !captured) {
+            if (!os_sleepto_ns(next))
+                next = os_gettime_ns();
+        } else {
+            next = os_gettime_ns();
+        }
+    }
+
+    // hand the session back, texture sessions are stopped on the graphics thread
+    if (capture->config.async) {
+        log_stats(capture);
+        backend->stop(params);
+    } else {
+        backend->release(params);
+    }
+    return NULL;
+}
+
+/**
+ * Start the capture thread if the capture is threaded
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param capture
+ *   Capture
+ *
+ * \return
+ *   True if the thread was started (or isn't needed), false otherwise
+ */
+static bool start_capture_thread(fbc_capture* capture) {
+    capture->config.params.threaded = capture->config.threaded;
+    if (!capture->config.threaded)
+        return true;
+
+    // the capture thread owns the session from now on
+    if (!capture->config.async)
+        capture->config.backend->release(&capture->config.params);
+
+    atomic_store(&capture->ring_head, 0);
+    atomic_store(&capture->ring_tail, 0);
+    atomic_store(&capture->thread_running, true);
+    if (pthread_create(&capture->thread, NULL, capture_thread, capture)) {
+        atomic_store(&capture->thread_running, false);
+
+        // system memory captures have no graphics thread to fall back to
+        if (capture->config.async) {
+            blog(LOG_ERROR, "Failed to create capture thread for nvfbc obs source");
+            return false;
+        }
+        capture->config.threaded = capture->config.params.threaded = false;
+        blog(LOG_ERROR, "Failed to create capture thread for nvfbc obs source, capturing on the graphics thread instead");
+    }
+    return true;
+}
+
+/**
+ * Stop the capture thread if it is running
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param capture
+ *   Capture
+ */
+static void stop_capture_thread(fbc_capture* capture) {
+    if (!atomic_load(&capture->thread_running))
+        return;
+
+    atomic_store(&capture->thread_running, false);
+    pthread_join(capture->thread, NULL);
+}
+
+/**
+ * Build the session of a texture capture
+ *
+ * The session is handed back before the capture is marked ready, so the
+ * graphics thread can take it over when the capture is activated.
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param data
+ *   Capture
+ */
+static void* startup_thread(void* data) {
+    fbc_capture* capture = (fbc_capture*) data;
+    os_set_thread_name("nvfbc-startup");
+
+    start_session(capture);
+    capture->config.backend->release(&capture->config.params);
+
+    atomic_store(&capture->state, CAPTURE_READY);
+    return NULL;
+}
+
+/**
+ * Destroy the textures of a capture
+ *
+ * Must be called with the graphics context entered.
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param capture
+ *   Texture capture
+ */
+static void destroy_textures(fbc_capture* capture) {
+    for (int i = 0; i < capture->config.params.texture_count; i++)
+        gs_texture_destroy(capture->textures[i]);
+    capture->config.params.texture_count = 0;
+}
+
+/**
+ * Create textures sharing the capture buffers, if the backend can wrap them
+ *
+ * Must be called with the graphics context entered.
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param capture
+ *   Texture capture
+ *
+ * \return
+ *   True if every buffer was wrapped, false otherwise
+ */
+static bool wrap_buffers(fbc_capture* capture) {
+    capture_params* params = &capture->config.params;
+    if (!capture->config.backend->wrap_buffer)
+        return false;
+
+    for (int i = 0; i < capture->config.backend->texture_count; i++) {
+        gs_texture_t* texture = capture->config.backend->wrap_buffer(params, i);
+        if (!texture) {
+            destroy_textures(capture);
+            return false;
+        }
+
+        GLuint gl_texture = *(GLuint*) gs_texture_get_obj(texture);
+        glBindTexture(GL_TEXTURE_2D, gl_texture);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glBindTexture(GL_TEXTURE_2D, 0);
+
+        capture->textures[i] = texture;
+        params->textures[i] = gl_texture;
+        params->texture_count = i + 1;
+    }
+    return true;
+}
+
+/**
+ * Create textures and back them with the capture buffers
+ *
+ * Must be called with the graphics context entered.
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param capture
+ *   Texture capture
+ *
+ * \return
+ *   True if the textures were created, false otherwise
+ */
+static bool create_textures(fbc_capture* capture) {
+    capture_params* params = &capture->config.params;
+
+    // textures wrapping the buffers don't need storage of their own
+    if (wrap_buffers(capture))
+        return true;
+
+    // (NvFBC's ToGL capture always double buffers)
+    for (int i = 0; i < capture->config.backend->texture_count; i++) {
+        gs_texture_t* texture = gs_texture_create(params->frame_width, params->frame_height, GS_BGRA, 1, NULL, GS_DYNAMIC);
+        if (!texture) {
+            blog(LOG_ERROR, "Failed to create texture for nvfbc obs source");
+            destroy_textures(capture);
+            return false;
+        }
+
+        GLuint gl_texture = *(GLuint*) gs_texture_get_obj(texture);
+        glBindTexture(GL_TEXTURE_2D, gl_texture);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_B, GL_RED);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_R, GL_BLUE);
+        glBindTexture(GL_TEXTURE_2D, 0);
+
+        capture->textures[i] = texture;
+        params->textures[i] = gl_texture;
+        params->texture_count = i + 1;
+    }
+
+    if (!capture->config.backend->export_textures(params)) {
+        blog(LOG_ERROR, "Failed to export capture buffers to the nvfbc obs source");
+        destroy_textures(capture);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Stop the lost session a texture capture recovered from
+ *
+ * Must be called with the graphics context entered.
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param capture
+ *   Texture capture
+ */
+static void drop_stale(fbc_capture* capture) {
+    for (int i = 0; i < capture->stale.texture_count; i++)
+        gs_texture_destroy(capture->stale_textures[i]);
+    capture->config.backend->stop(&capture->stale);
+    capture->has_stale = false;
+}
+
+/**
+ * Stop the session of a texture capture and free it
+ *
+ * Must be called with the graphics context entered, unless the capture has
+ * neither textures nor a lost session anymore.
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param capture
+ *   Texture capture without a startup thread
+ */
+static void free_capture(fbc_capture* capture) {
+    stop_capture_thread(capture);
+    int state = atomic_load(&capture->state);
+    if (state != CAPTURE_STARTING && state != CAPTURE_FAILED)
+        log_stats(capture);
+    destroy_textures(capture);
+    capture->config.backend->stop(&capture->config.params);
+    if (capture->has_stale)
+        drop_stale(capture);
+
+    timing_log(&capture->timings, capture->config.backend->name);
+    pthread_mutex_destroy(&capture->pending_lock);
+    bfree(capture);
+}
+
+/**
+ * Wait for the startup thread of a released capture, then free it
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param data
+ *   Texture capture whose textures and lost session were destroyed already
+ */
+static void* reaper_thread(void* data) {
+    fbc_capture* capture = (fbc_capture*) data;
+    os_set_thread_name("nvfbc-reaper");
+
+    pthread_join(capture->startup_thread, NULL);
+    free_capture(capture);
+
+    pthread_mutex_lock(&reaper_lock);
+    reapers--;
+    pthread_cond_broadcast(&reaper_done);
+    pthread_mutex_unlock(&reaper_lock);
+    return NULL;
+}
+
+/**
+ * Stop a capture and free it
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param capture
+ *   Capture no source uses anymore
+ */
+static void destroy_capture(fbc_capture* capture) {
+    if (capture->config.async) {
+        // the capture thread stops its own session, unless it never ran
+        if (atomic_load(&capture->thread_running))
+            stop_capture_thread(capture);
+        if (capture->retired)
+            capture_release(capture->retired);
+
+        timing_log(&capture->timings, capture->config.backend->name);
+        pthread_mutex_destroy(&capture->pending_lock);
+        bfree(capture);
+        return;
+    }
+
+    // a session that is still being built has to finish before it can be stopped, but the caller
+    // holds the graphics context, so the capture is freed by a reaper once the startup thread is done
+    // (the new session has no textures yet, only the lost one needs the graphics context)
+    if (capture->has_startup_thread) {
+        if (capture->has_stale)
+            drop_stale(capture);
+
+        pthread_mutex_lock(&reaper_lock);
+        reapers++;
+        pthread_mutex_unlock(&reaper_lock);
+
+        pthread_t reaper;
+        if (!pthread_create(&reaper, NULL, reaper_thread, capture)) {
+            pthread_detach(reaper);
+            return;
+        }
+
+        // (the startup thread never enters the graphics context, so waiting for it here is slow, but safe)
+        blog(LOG_WARNING, "Failed to create reaper thread for nvfbc obs source, waiting for the session to be built");
+        pthread_mutex_lock(&reaper_lock);
+        reapers--;
+        pthread_mutex_unlock(&reaper_lock);
+        pthread_join(capture->startup_thread, NULL);
+    }
+
+    free_capture(capture);
+}
+
+settings_change capture_classify(const capture_config* current, const capture_config* config) {
+    const capture_params* a = &current->params;
+    const capture_params* b = &config->params;
+
+    // everything NvFBC is set up with needs a new session
+    if (current->backend != config->backend || current->async != config->async
+        || a->tracking_type != b->tracking_type || strcmp(a->display_name, b->display_name)
+        || a->frame_width != b->frame_width || a->frame_height != b->frame_height
+        || a->with_cursor != b->with_cursor || a->push_model != b->push_model
+        || a->sampling_rate != b->sampling_rate || a->direct_mode != b->direct_mode
+        || a->with_diffmap != b->with_diffmap || a->diffmap_scale != b->diffmap_scale
+        || a->format != b->format || a->has_capture_area != b->has_capture_area
+        || a->opaque_buffers != b->opaque_buffers)
+        return CHANGE_SESSION;
+    if (a->has_capture_area && (a->capture_x != b->capture_x || a->capture_y != b->capture_y
+        || a->capture_width != b->capture_width || a->capture_height != b->capture_height))
+        return CHANGE_SESSION;
+
+    // grab flags, the frame ring and the capture thread belong to the plugin
+    if (a->mode != b->mode || current->threaded != config->threaded || current->use_timestamps != config->use_timestamps)
+        return CHANGE_INPLACE;
+
+    return CHANGE_NONE;
+}
+
+fbc_capture* capture_acquire(const capture_config* config, obs_source_t* output, fbc_capture* retired, bool share) {
+    pthread_mutex_lock(&registry_lock);
+
+    // texture captures are shared by every source that wants the same frames
+    if (share && !config->async) {
+        for (fbc_capture* capture = captures; capture; capture = capture->next_capture) {
+            if (atomic_load(&capture->state) == CAPTURE_FAILED || capture_classify(&capture->key, config) != CHANGE_NONE)
+                continue;
+
+            capture->refs++;
+            pthread_mutex_unlock(&registry_lock);
+            return capture;
+        }
+    }
+
+    fbc_capture* capture = bzalloc(sizeof(fbc_capture));
+    capture->key = *config;
+    capture->config = *config;
+    capture->config.params.timings = &capture->timings;
+    capture->refs = 1;
+    capture->output = output;
+    capture->retired = retired;
+    capture->stats.changed_area = 1.0f;
+    pthread_mutex_init(&capture->pending_lock, NULL);
+
+    if (config->async) {
+        // system memory captures build their session on their capture thread
+        atomic_store(&capture->state, CAPTURE_STARTING);
+        if (!start_capture_thread(capture))
+            atomic_store(&capture->state, CAPTURE_FAILED);
+    } else {
+        // texture captures build theirs on the startup thread, the textures are created when they're activated
+        // (anything the session needs from the graphics context is looked up here, the startup thread can't enter it)
+        capture->next_capture = captures;
+        captures = capture;
+        if (capture->config.backend->prepare)
+            capture->config.backend->prepare(&capture->config.params);
+        atomic_store(&capture->state, CAPTURE_STARTING);
+        capture->has_startup_thread = !pthread_create(&capture->startup_thread, NULL, startup_thread, capture);
+        if (!capture->has_startup_thread) {
+            blog(LOG_WARNING, "Failed to create startup thread for nvfbc obs source, starting synchronously");
+            startup_thread(capture);
+        }
+    }
+
+    pthread_mutex_unlock(&registry_lock);
+    return capture;
+}
+
+bool capture_activate(fbc_capture* capture) {
+    // (captures that lost their session are still alive)
+    int state = atomic_load(&capture->state);
+    if (state != CAPTURE_READY)
+        return state != CAPTURE_FAILED;
+
+    // (the startup thread is done once the capture is ready, so this doesn't wait)
+    if (capture->has_startup_thread) {
+        pthread_join(capture->startup_thread, NULL);
+        capture->has_startup_thread = false;
+    }
+
+    uint64_t start = timing_begin(STAGE_SWAP);
+    if (!create_textures(capture)) {
+        // a recovering capture still has the textures of its lost session, so it can try again
+        if (capture->has_stale) {
+            memcpy(capture->textures, capture->stale_textures, sizeof(capture->textures));
+            lose_session(capture);
+        } else {
+            atomic_store(&capture->state, CAPTURE_FAILED);
+        }
+        timing_end(&capture->timings, STAGE_SWAP, start);
+        return capture->has_stale;
+    }
+
+    capture->current_texture = 0;
+    capture->drawn_texture = -1;
+    capture->frame_time = 0;
+    atomic_store(&capture->state, CAPTURE_RUNNING);
+    start_capture_thread(capture);
+    timing_end(&capture->timings, STAGE_SWAP, start);
+    return true;
+}
+
+bool capture_reconfigure(fbc_capture* capture, const capture_config* config) {
+    pthread_mutex_lock(&registry_lock);
+    settings_change change = capture_classify(&capture->key, config);
+    bool owned = capture->refs == 1 && atomic_load(&capture->state) == CAPTURE_RUNNING;
+    if (change == CHANGE_INPLACE && owned) {
+        // (updated under the registry lock, as other sources look for captures by their key)
+        capture->key = *config;
+    }
+    pthread_mutex_unlock(&registry_lock);
+
+    if (change != CHANGE_INPLACE)
+        return change == CHANGE_NONE;
+    if (!owned)
+        return false;
+
+    // system memory captures pick up the changes between two grabs
+    if (capture->config.async) {
+        pthread_mutex_lock(&capture->pending_lock);
+        capture->pending = *config;
+        atomic_store(&capture->has_pending, true);
+        pthread_mutex_unlock(&capture->pending_lock);
+        return true;
+    }
+
+    // texture captures restart their capture thread, the ring can't hold more frames than there are free textures
+    stop_capture_thread(capture);
+    capture_params* params = &capture->config.params;
+    params->mode = config->params.mode;
+    capture->config.threaded = config->threaded;
+    capture->config.use_timestamps = config->use_timestamps;
+    start_capture_thread(capture);
+    return true;
+}
+
+bool capture_needs_recovery(fbc_capture* capture) {
+    int state = atomic_load(&capture->state);
+    if (state == CAPTURE_LOST)
+        return os_gettime_ns() >= atomic_load(&capture->retry_at);
+
+    return state == CAPTURE_READY || (state == CAPTURE_RUNNING && capture->has_stale && !atomic_load(&capture->lost_at));
+}
+
+void capture_recover(fbc_capture* capture) {
+    int state = atomic_load(&capture->state);
+
+    // the new session delivered a frame, so the lost one isn't shown anymore
+    if (state == CAPTURE_RUNNING && capture->has_stale && !atomic_load(&capture->lost_at)) {
+        drop_stale(capture);
+        return;
+    }
+
+    if (state == CAPTURE_READY) {
+        capture_activate(capture);
+        return;
+    }
+
+    if (state != CAPTURE_LOST || os_gettime_ns() < atomic_load(&capture->retry_at))
+        return;
+
+    // the capture thread stopped by itself, the startup thread finished building the last attempt
+    stop_capture_thread(capture);
+    if (capture->has_startup_thread) {
+        pthread_join(capture->startup_thread, NULL);
+        capture->has_startup_thread = false;
+    }
+
+    capture_params* params = &capture->config.params;
+    if (capture->has_stale) {
+        // the last attempt never delivered a frame, the lost session still holds the last good one
+        destroy_textures(capture);
+        capture->config.backend->stop(params);
+        memcpy(capture->textures, capture->stale_textures, sizeof(capture->textures));
+    } else {
+        capture->stale = *params;
+        memcpy(capture->stale_textures, capture->textures, sizeof(capture->textures));
+        capture->stale_texture = capture->current_texture;
+        capture->has_stale = true;
+    }
+    params->user_data = NULL;
+    params->texture_count = 0;
+    atomic_fetch_add(&capture->stats.recovery_attempts, 1);
+
+    // (the session is built off the graphics thread, like the first one)
+    atomic_store(&capture->state, CAPTURE_RECOVERING);
+    capture->has_startup_thread = !pthread_create(&capture->startup_thread, NULL, startup_thread, capture);
+    if (!capture->has_startup_thread)
+        startup_thread(capture);
+}
+
+gs_texture_t* capture_render_frame(fbc_capture* capture) {
+    capture_stats* stats = &capture->stats;
+    capture_params* params = &capture->config.params;
+
+    // capture a frame once per OBS frame (or pick up the newest one from the capture thread)
+    uint64_t frame_time = obs_get_video_frame_time();
+    bool first_render = capture->frame_time != frame_time;
+    capture->frame_time = frame_time;
+    stats->renders++;
+    if (!first_render)
+        stats->duplicate_renders++;
+
+    // fence every draw of the last OBS frame at once, before the texture they read can be captured into again
+    if (first_render && capture->drawn_texture >= 0) {
+        if (capture->config.backend->sampled && atomic_load(&capture->state) == CAPTURE_RUNNING)
+            capture->config.backend->sampled(params, capture->drawn_texture);
+        capture->drawn_texture = -1;
+    }
+
+    if (capture->config.threaded && first_render) {
+        // find the frames that are due (with timestamps, frames captured after this OBS frame wait for the next one)
+        uint64_t head = atomic_load_explicit(&capture->ring_head, memory_order_acquire);
+        uint64_t tail = atomic_load_explicit(&capture->ring_tail, memory_order_relaxed);
+        uint64_t due = head;
+        if (capture->config.use_timestamps) {
+            for (due = tail; due < head; due++)
+                if (capture->ring[due % MAX_BUFFERS].timestamp > frame_time)
+                    break;
+        }
+
+        // show the newest due frame
+        if (due != tail) {
+            show_frame(capture, &capture->ring[(due - 1) % MAX_BUFFERS]);
+            atomic_store_explicit(&capture->ring_tail, due, memory_order_release);
+        }
+    } else if (first_render && atomic_load(&capture->state) == CAPTURE_RUNNING) {
+        // keep showing the current texture unless the grab produced a new frame
+        frame_info frame = { 0 };
+        uint64_t start = timing_begin(STAGE_GRAB);
+        bool captured = capture->config.backend->grab(params, &frame);
+        timing_end(&capture->timings, STAGE_GRAB, start);
+        if (captured)
+            atomic_fetch_add_explicit(&stats->grabs, 1, memory_order_relaxed);
+        else
+            log_grab_failure(capture, &frame);
+        if (!captured && frame.lost)
+            lose_session(capture);
+
+        if (captured && frame.is_new) {
+            show_frame(capture, &(frame_slot) {
+                .texture = frame.texture,
+                .timestamp = capture->config.use_timestamps ? map_timestamp(capture, frame.timestamp_us) : 0,
+                .changed_area = frame.changed_area
+            });
+        }
+    }
+
+    // until the new session delivers a frame, the last one of the lost session stays visible
+    if (capture->has_stale && atomic_load(&capture->lost_at))
+        return capture->stale_textures[capture->stale_texture];
+    return capture->textures[capture->current_texture];
+}
+
+void capture_sampled(fbc_capture* capture) {
+    // (the stale frame belongs to a session that doesn't capture anymore)
+    if (atomic_load(&capture->state) != CAPTURE_RUNNING || (capture->has_stale && atomic_load(&capture->lost_at)))
+        return;
+    capture->drawn_texture = capture->current_texture;
+}
+
+void capture_release(fbc_capture* capture) {
+    pthread_mutex_lock(&registry_lock);
+    bool last = --capture->refs == 0;
+    if (last && !capture->config.async) {
+        fbc_capture** link = &captures;
+        while (*link != capture)
+            link = &(*link)->next_capture;
+        *link = capture->next_capture;
+    }
+    pthread_mutex_unlock(&registry_lock);
+
+    if (last)
+        destroy_capture(capture);
+}
+
+void capture_shutdown() {
+    pthread_mutex_lock(&reaper_lock);
+    while (reapers)
+        pthread_cond_wait(&reaper_done, &reaper_lock);
+    pthread_mutex_unlock(&reaper_lock);
+}
@@ -0,0 +1,259 @@
+#pragma once
+
+#include "source.h"
+#include "backend.h"
+
+#include <obs/obs-module.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+typedef enum {
+    CHANGE_NONE, //!< Nothing the capture depends on changed
+    CHANGE_INPLACE, //!< Only options of the plugin changed, the session is kept
+    CHANGE_SESSION //!< NvFBC has to be set up again, a new session is needed
+} settings_change; //!< Cost of going from one capture configuration to another
+
+typedef enum {
+    CAPTURE_STARTING, //!< Session is being built on the startup thread
+    CAPTURE_READY, //!< Session is built, capturing starts once it is activated
+    CAPTURE_RUNNING, //!< Capturing
+    CAPTURE_LOST, //!< Session was lost, the last frame stays visible until a new one is built
+    CAPTURE_RECOVERING, //!< Session replacing the lost one is being built on the startup thread
+    CAPTURE_FAILED //!< Textures couldn't be set up, the capture is never shared again
+} capture_state; //!< Lifecycle state of a capture
+
+typedef struct {
+    const capture_backend* backend; //!< Capture backend
+    capture_params params; //!< Capture parameters
+    bool async; //!< Whether frames are handed to an async source instead of being exported to textures
+    bool threaded; //!< Whether frames are captured on a dedicated thread
+    bool use_timestamps; //!< Whether frames are scheduled by their NvFBC capture timestamp
+} capture_config; //!< Capture configuration read from the source settings
+
+typedef struct {
+    int texture; //!< Index of the texture holding the frame
+    uint64_t timestamp; //!< Capture time of the frame in os_gettime_ns() time (if timestamps are used)
+    float changed_area; //!< Fraction of the frame that changed since the previous grab
+} frame_slot; //!< Captured frame waiting to be rendered
+
+typedef struct {
+    atomic_uint_fast64_t grabs; //!< Number of grabs since the capture started
+    uint64_t renders; //!< Number of render calls since the capture started
+    uint64_t duplicate_renders; //!< Number of render calls that reused a grab from the same OBS frame
+    uint64_t latency_last; //!< Capture-to-render latency of the last shown frame in ns
+    uint64_t latency_total; //!< Sum of all capture-to-render latencies in ns
+    uint64_t latency_max; //!< Highest capture-to-render latency in ns
+    uint64_t latency_frames; //!< Number of frames the latency was measured for
+    float changed_area; //!< Fraction of the frame that changed in the last shown frame
+    double changed_total; //!< Sum of the changed fractions of all shown frames
+    uint64_t changed_frames; //!< Number of frames the changed fraction was measured for
+    uint64_t idle_frames; //!< Number of new frames in which nothing changed
+    atomic_uint_fast64_t failed_grabs; //!< Number of grabs that failed
+    atomic_uint_fast64_t recoveries; //!< Number of times a lost session was replaced by a working one
+    atomic_uint_fast64_t recovery_attempts; //!< Number of sessions built to replace a lost one
+    atomic_uint_fast64_t recovery_last; //!< Time from losing the session to the first new frame of the last recovery in ns
+    atomic_uint_fast64_t recovery_total; //!< Sum of all recovery times in ns
+    atomic_uint_fast64_t recovery_max; //!< Longest recovery time in ns
+} capture_stats; //!< Statistics of a capture
+
+typedef struct fbc_capture {
+    capture_config key; //!< Configuration the capture was requested with
+    capture_config config; //!< Configuration of the session (adjusted by the backend)
+    int refs; //!< Number of sources using the capture (guarded by the registry lock)
+    struct fbc_capture* next_capture; //!< Next capture in the registry
+    obs_source_t* output; //!< Source the frames are handed to (system memory captures only)
+    struct fbc_capture* retired; //!< Capture replaced by this one, released once this one runs (system memory captures only)
+
+    atomic_int state; //!< Lifecycle state (see capture_state)
+    pthread_t startup_thread; //!< Thread building the session (texture captures only)
+    bool has_startup_thread; //!< Whether startup_thread has to be joined
+    gs_texture_t* textures[MAX_BUFFERS]; //!< Textures backed by the capture buffers
+
+    pthread_t thread; //!< Capture thread
+    atomic_bool thread_running; //!< Whether the capture thread should keep running
+    frame_slot ring[MAX_BUFFERS]; //!< Frames handed from the capture thread to render()
+    atomic_uint_fast64_t ring_head; //!< Number of frames pushed by the capture thread
+    atomic_uint_fast64_t ring_tail; //!< Number of frames taken by render()
+    int current_texture; //!< Index of the texture currently shown
+    int drawn_texture; //!< Texture drawn since the current OBS frame began (-1 if none, graphics thread only)
+    uint64_t frame_time; //!< OBS frame in which the capture last advanced
+
+    pthread_mutex_t pending_lock; //!< Lock protecting pending
+    capture_config pending; //!< In-place changes for the capture thread to pick up (system memory captures only)
+    atomic_bool has_pending; //!< Whether pending has to be picked up
+
+    atomic_uint_fast64_t lost_at; //!< Time the session was lost in os_gettime_ns() time (0 while it works)
+    atomic_uint_fast64_t retry_at; //!< Earliest time to build the next replacement session
+    atomic_uint_fast64_t backoff; //!< Delay between the next failed attempt and the one after it in ns
+    capture_params stale; //!< Lost session, kept until its replacement delivers a frame (texture captures only)
+    gs_texture_t* stale_textures[MAX_BUFFERS]; //!< Textures of the lost session, still holding its last frame
+    int stale_texture; //!< Index of the texture holding the last frame of the lost session
+    bool has_stale; //!< Whether stale has to be stopped
+    uint64_t log_at; //!< Earliest time to log the next failed grab
+    uint64_t suppressed_logs; //!< Number of failed grabs that weren't logged since the last message
+
+    bool has_clock_offset; //!< Whether clock_offset has been measured
+    int64_t clock_offset; //!< Offset from NvFBC timestamps to os_gettime_ns() in ns
+    capture_stats stats; //!< Statistics since the capture started
+    stage_timings timings; //!< Timings of the capture stages over the lifetime of the capture
+} fbc_capture; //!< NvFBC capture, shared by every texture source with the same configuration
+
+/**
+ * Classify what it takes to go from one capture configuration to another
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param current
+ *   Running configuration
+ * \param config
+ *   New configuration
+ *
+ * \return
+ *   Cheapest way to apply the new configuration
+ */
+settings_change capture_classify(const capture_config* current, const capture_config* config);
+
+/**
+ * Get a capture for a configuration
+ *
+ * Texture captures with the same configuration are shared, everything else
+ * gets a new capture whose session is built in the background. Texture
+ * captures must be acquired with the graphics context entered.
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param config
+ *   Capture configuration
+ * \param output
+ *   Source to hand frames to (system memory captures only)
+ * \param retired
+ *   Capture to release once the new one produces frames (system memory captures only, may be NULL)
+ * \param share
+ *   Whether an existing capture may be reused
+ *
+ * \return
+ *   Capture, released with capture_release()
+ */
+fbc_capture* capture_acquire(const capture_config* config, obs_source_t* output, fbc_capture* retired, bool share);
+
+/**
+ * Start capturing into the textures once the session is built
+ *
+ * Must be called with the graphics context entered.
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param capture
+ *   Texture capture that isn't starting anymore
+ *
+ * \return
+ *   True if the capture is running, false if it failed
+ */
+bool capture_activate(fbc_capture* capture);
+
+/**
+ * Apply a configuration to a running capture without a new session
+ *
+ * Only works for captures no other source uses. Texture captures must be
+ * reconfigured with the graphics context entered.
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param capture
+ *   Capture
+ * \param config
+ *   New configuration
+ *
+ * \return
+ *   True if the capture now matches the configuration, false if a new capture is needed
+ */
+bool capture_reconfigure(fbc_capture* capture, const capture_config* config);
+
+/**
+ * Check whether a texture capture waits for the graphics thread to recover
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param capture
+ *   Texture capture
+ *
+ * \return
+ *   True if capture_recover() has something to do, false otherwise
+ */
+bool capture_needs_recovery(fbc_capture* capture);
+
+/**
+ * Advance the recovery of a texture capture that lost its session
+ *
+ * Once the backoff delay passed, a new session is built on the startup thread
+ * while the textures of the lost one keep showing its last frame. The lost
+ * session is stopped after the new one delivered its first frame.
+ * Must be called with the graphics context entered.
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param capture
+ *   Texture capture
+ */
+void capture_recover(fbc_capture* capture);
+
+/**
+ * Pick the frame to show in the current OBS frame
+ *
+ * Only the first call per OBS frame grabs (or takes a frame from the capture
+ * thread), so every source sharing the capture shows the same frame.
+ * Must be called with the graphics context entered.
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param capture
+ *   Running texture capture
+ *
+ * \return
+ *   Texture holding the frame
+ */
+gs_texture_t* capture_render_frame(fbc_capture* capture);
+
+/**
+ * Note that the frame returned by capture_render_frame() was drawn
+ *
+ * The draws of an OBS frame are handed to the backend at once, when the next
+ * OBS frame renders the capture for the first time. The backend won't capture
+ * into the texture again before the GPU finished them. Must be called with the
+ * graphics context entered.
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param capture
+ *   Running texture capture
+ */
+void capture_sampled(fbc_capture* capture);
+
+/**
+ * Release a capture, stopping it if no other source uses it
+ *
+ * Texture captures must be released with the graphics context entered.
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param capture
+ *   Capture
+ */
+void capture_release(fbc_capture* capture);
+
+/**
+ * Wait for released captures whose session was still being built
+ *
+ * \author
+ *   PancakeTAS
+ */
+void capture_shutdown();
@@ -0,0 +1,166 @@
+#include "backend.h"
+
+#include <obs/obs-module.h>
+#include <obs/util/platform.h>
+#include <stdlib.h>
+
+typedef struct {
+    uint32_t* buffer; //!< BGRA frame buffer
+    uint32_t width, height; //!< Size of the frames (the OBS base resolution if the frame size is 0)
+    uint64_t interval; //!< Time between two frames in ns
+    uint64_t frame; //!< Number of the last drawn frame (in intervals since the clock started)
+    backend_stats stats; //!< Statistics since start
+} cpu_user; //!< CPU backend user data
+
+/**
+ * Return the capabilities of the CPU backend
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \return
+ *   Capabilities
+ */
+static uint32_t cpu_capabilities() {
+    return BACKEND_CAP_SYSTEM_MEMORY;
+}
+
+/**
+ * Start drawing frames
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param params
+ *   Capture parameters
+ */
+static void start_cpu_capture(capture_params* params) {
+    blog(LOG_INFO, "Starting CPU capture");
+
+    cpu_user* user_data = (cpu_user*) calloc(1, sizeof(cpu_user));
+    params->user_data = user_data;
+
+    // produce frames at the OBS frame rate, like the display would (and at its size, like NvFBC does without a frame size)
+    struct obs_video_info ovi;
+    bool has_video = obs_get_video_info(&ovi);
+    user_data->interval = 16666667;
+    if (has_video && ovi.fps_num)
+        user_data->interval = 1000000000ULL * ovi.fps_den / ovi.fps_num;
+    user_data->width = params->frame_width ? (uint32_t) params->frame_width : has_video ? ovi.base_width : 0;
+    user_data->height = params->frame_height ? (uint32_t) params->frame_height : has_video ? ovi.base_height : 0;
+    if (user_data->width && user_data->height)
+        user_data->buffer = (uint32_t*) calloc((size_t) user_data->width * user_data->height, sizeof(uint32_t));
+}
+
+/**
+ * Grab a frame, drawing a new test pattern for every display interval
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param params
+ *   Capture parameters
+ * \param frame
+ *   Grabbed frame
+ *
+ * \return
+ *   True if a frame was captured, false otherwise
+ */
+static bool capture_cpu_frame(capture_params* params, frame_info* frame) {
+    cpu_user* user_data = (cpu_user*) params->user_data;
+    if (!user_data->buffer) {
+        frame->status = 0;
+        frame->lost = true;
+        user_data->stats.failures++;
+        return false;
+    }
+
+    // wait for the next interval like NvFBC waits for the next frame
+    uint64_t ready = os_gettime_ns() / user_data->interval;
+    if (params->mode == GRAB_MODE_BLOCKING || (params->mode == GRAB_MODE_NOWAIT_IF_NEW_FRAME_READY && ready <= user_data->frame)) {
+        ready = (ready > user_data->frame ? ready : user_data->frame) + 1;
+        os_sleepto_ns(ready * user_data->interval);
+    }
+
+    // draw a scrolling gradient
+    frame->is_new = ready > user_data->frame;
+    if (frame->is_new) {
+        for (uint32_t y = 0; y < user_data->height; y++) {
+            uint32_t* row = user_data->buffer + (size_t) y * user_data->width;
+            for (uint32_t x = 0; x < user_data->width; x++) {
+                uint32_t value = (x + y + ready * 4) & 0xFF;
+                row[x] = 0xFF000000 | value << 16 | value << 8 | value;
+            }
+        }
+        user_data->frame = ready;
+        user_data->stats.new_frames++;
+        user_data->stats.bytes += (uint64_t) user_data->width * user_data->height * 4;
+    }
+
+    frame->data = (uint8_t*) user_data->buffer;
+    frame->linesize = user_data->width * 4;
+    frame->width = user_data->width;
+    frame->height = user_data->height;
+    frame->number = (uint32_t) user_data->frame;
+    frame->timestamp_us = user_data->frame * user_data->interval / 1000;
+    frame->diffmap = NULL;
+    frame->changed_area = 1.0f;
+    user_data->stats.grabs++;
+    return true;
+}
+
+/**
+ * Release the capture from the calling thread
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param params
+ *   Capture parameters
+ */
+static void release_cpu_capture(capture_params* params) {
+    // (nothing is bound to the thread)
+}
+
+/**
+ * Read the capture statistics
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param params
+ *   Capture parameters
+ * \param stats
+ *   Statistics since start
+ */
+static void get_cpu_stats(capture_params* params, backend_stats* stats) {
+    *stats = ((cpu_user*) params->user_data)->stats;
+}
+
+/**
+ * Stop drawing frames
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param params
+ *   Capture parameters
+ */
+static void stop_cpu_capture(capture_params* params) {
+    blog(LOG_INFO, "Stopping CPU capture");
+    cpu_user* user_data = (cpu_user*) params->user_data;
+
+    free(user_data->buffer);
+    free(user_data);
+}
+
+const capture_backend cpu_backend = {
+    .id = "cpu",
+    .name = "CPU test pattern",
+    .capabilities = cpu_capabilities,
+    .start = start_cpu_capture,
+    .grab = capture_cpu_frame,
+    .release = release_cpu_capture,
+    .get_stats = get_cpu_stats,
+    .stop = stop_cpu_capture
+};
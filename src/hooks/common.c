@@ -0,0 +1,309 @@
+#include "hooks.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+const hook_symbol* hooks_find(const hook_symbol* table, size_t count, const char* name) {
+    size_t length = strlen(name);
+    for (size_t i = 0; i < count; i++) {
+        if (table[i].length == length && !memcmp(table[i].name, name, length))
+            return &table[i];
+    }
+    return NULL;
+}
+
+hook_session* hooks_recording_session(NvFBCCustomState* state) {
+    pthread_t self = pthread_self();
+    for (int i = 0; i < HOOKS_MAX_SESSIONS; i++) {
+        hook_session* session = &state->sessions[i];
+        if (atomic_load_explicit(&session->state, memory_order_acquire) == HOOK_SESSION_RECORDING && pthread_equal(session->owner, self))
+            return session;
+    }
+    return NULL;
+}
+
+void hooks_record_allocation(hook_session* session, VkInstance instance, VkDevice device, VkDeviceSize size, VkDeviceMemory memory) {
+    if (!session->device) {
+        session->device = device;
+        session->instance = instance;
+    } else if (session->device != device) {
+        return;
+    }
+
+    // keep the most recent large allocations, NvFBC's texture indices follow the allocation order
+    int index = session->count++ % NVFBC_TOGL_TEXTURES_MAX;
+    session->memory[index] = memory;
+    session->size[index] = size;
+    session->bound[index] = (hook_image) { 0 };
+}
+
+void hooks_record_free(NvFBCCustomState* state, VkDeviceMemory memory) {
+    uint64_t number = atomic_fetch_add_explicit(&state->frees, 1, memory_order_relaxed);
+    hook_free* entry = &state->freed[number % HOOKS_FREED_HISTORY];
+
+    // (the slot is marked while it is written, so readers never mistake the memory for that of an older free)
+    atomic_store_explicit(&entry->number, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&entry->memory, (uint64_t) (uintptr_t) memory, memory_order_relaxed);
+    atomic_store_explicit(&entry->number, number + 1, memory_order_release);
+}
+
+bool hooks_freed_since(NvFBCCustomState* state, VkDeviceMemory memory, uint64_t* since) {
+    uint64_t frees = atomic_load_explicit(&state->frees, memory_order_acquire);
+    if (frees - *since > HOOKS_FREED_HISTORY)
+        return true;
+
+    uint64_t checked = frees;
+    for (uint64_t i = *since; i < frees; i++) {
+        hook_free* entry = &state->freed[i % HOOKS_FREED_HISTORY];
+        uint64_t number = atomic_load_explicit(&entry->number, memory_order_acquire);
+        uint64_t freed = atomic_load_explicit(&entry->memory, memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+        if (number > i + 1 || atomic_load_explicit(&entry->number, memory_order_relaxed) != number)
+            return true; // overwritten by a newer free
+
+        // a free that is still being recorded is looked at again by the next check
+        if (number != i + 1) {
+            if (checked > i)
+                checked = i;
+            continue;
+        }
+        if (freed == (uint64_t) (uintptr_t) memory)
+            return true;
+    }
+    *since = checked;
+    return false;
+}
+
+/**
+ * Check whether a device supports an extension
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param extensions
+ *   Extensions of the device
+ * \param count
+ *   Number of extensions
+ * \param name
+ *   Name of the extension
+ *
+ * \return
+ *   True if the extension is supported, false otherwise
+ */
+static bool has_extension(const VkExtensionProperties* extensions, uint32_t count, const char* name) {
+    for (uint32_t i = 0; i < count; i++) {
+        if (!strncmp(extensions[i].extensionName, name, VK_MAX_EXTENSION_NAME_SIZE))
+            return true;
+    }
+    return false;
+}
+
+const char** hooks_device_extensions(hook_session* session, VkPhysicalDevice physical_device, const VkDeviceCreateInfo* info,
+        PFN_vkEnumerateDeviceExtensionProperties enumerate, uint32_t* count) {
+    if (!session || !session->modifier_count || !enumerate)
+        return NULL;
+
+    static const char* const required[HOOKS_MODIFIER_EXTENSIONS] = {
+        VK_EXT_IMAGE_DRM_FORMAT_MODIFIER_EXTENSION_NAME,
+        VK_EXT_EXTERNAL_MEMORY_DMA_BUF_EXTENSION_NAME,
+        VK_KHR_IMAGE_FORMAT_LIST_EXTENSION_NAME
+    };
+    uint32_t supported_count = 0;
+    enumerate(physical_device, NULL, &supported_count, NULL);
+    VkExtensionProperties* supported = calloc(supported_count ? supported_count : 1, sizeof(VkExtensionProperties));
+    const char** names = calloc(info->enabledExtensionCount + HOOKS_MODIFIER_EXTENSIONS, sizeof(const char*));
+    bool usable = supported && names && enumerate(physical_device, NULL, &supported_count, supported) == VK_SUCCESS;
+
+    // add what NvFBC didn't enable itself (VK_KHR_image_format_list is core since 1.2, but enabling it is harmless)
+    uint32_t enabled = info->enabledExtensionCount;
+    for (uint32_t i = 0; usable && i < enabled; i++)
+        names[i] = info->ppEnabledExtensionNames[i];
+    for (int i = 0; usable && i < HOOKS_MODIFIER_EXTENSIONS; i++) {
+        bool listed = false;
+        for (uint32_t j = 0; j < info->enabledExtensionCount && !listed; j++)
+            listed = !strcmp(info->ppEnabledExtensionNames[j], required[i]);
+        usable = listed || has_extension(supported, supported_count, required[i]);
+        if (usable && !listed)
+            names[enabled++] = required[i];
+    }
+
+    free(supported);
+    if (!usable) {
+        free(names);
+        return NULL;
+    }
+    *count = enabled;
+    return names;
+}
+
+/**
+ * Rewrite the create info of an image that may hold a capture to use modifier tiling
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param session
+ *   Session slot with the modifiers
+ * \param info
+ *   NvFBC's create info
+ * \param rewritten
+ *   Rewritten create info
+ *
+ * \return
+ *   True if the image was rewritten, false if it is left alone
+ */
+static bool rewrite_image(const hook_session* session, const VkImageCreateInfo* info, hook_image_info* rewritten) {
+    // captures are single 2D BGRA images, NvFBC's other images keep their tiling
+    if (info->imageType != VK_IMAGE_TYPE_2D || info->mipLevels != 1 || info->arrayLayers != 1 || info->samples != VK_SAMPLE_COUNT_1_BIT
+        || (info->format != VK_FORMAT_B8G8R8A8_UNORM && info->format != VK_FORMAT_R8G8B8A8_UNORM) || info->tiling != VK_IMAGE_TILING_OPTIMAL)
+        return false;
+
+    *rewritten = (hook_image_info) {
+        .info = *info,
+        .modifiers = {
+            .sType = VK_STRUCTURE_TYPE_IMAGE_DRM_FORMAT_MODIFIER_LIST_CREATE_INFO_EXT,
+            .drmFormatModifierCount = (uint32_t) session->modifier_count,
+            .pDrmFormatModifiers = session->modifiers
+        },
+        .external = {
+            .sType = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_IMAGE_CREATE_INFO,
+            .handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT
+        }
+    };
+
+    // (only structures the hooks know how to copy, anything else leaves the image alone)
+    bool has_formats = false;
+    for (const VkBaseInStructure* next = info->pNext; next; next = next->pNext) {
+        if (next->sType == VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_IMAGE_CREATE_INFO) {
+            rewritten->external.handleTypes |= ((const VkExternalMemoryImageCreateInfo*) next)->handleTypes;
+        } else if (next->sType == VK_STRUCTURE_TYPE_IMAGE_FORMAT_LIST_CREATE_INFO) {
+            rewritten->formats = *(const VkImageFormatListCreateInfo*) next;
+            has_formats = true;
+        } else {
+            return false;
+        }
+    }
+
+    rewritten->info.tiling = VK_IMAGE_TILING_DRM_FORMAT_MODIFIER_EXT;
+    rewritten->info.pNext = &rewritten->modifiers;
+    rewritten->modifiers.pNext = &rewritten->external;
+    rewritten->external.pNext = has_formats ? &rewritten->formats : NULL;
+    rewritten->formats.pNext = NULL;
+    return true;
+}
+
+VkResult hooks_create_image(hook_session* session, VkDevice device, const VkImageCreateInfo* info, const VkAllocationCallbacks* allocator, VkImage* image,
+        PFN_vkCreateImage create, PFN_vkGetImageDrmFormatModifierPropertiesEXT get_modifier, PFN_vkGetImageSubresourceLayout get_layout) {
+    hook_image_info rewritten;
+    if (!session || !session->modifier_count || session->image_count >= HOOKS_MAX_IMAGES || !get_modifier || !get_layout || !rewrite_image(session, info, &rewritten))
+        return create(device, info, allocator, image);
+
+    // (the driver rejects the list if none of the modifiers supports NvFBC's usage)
+    if (create(device, &rewritten.info, allocator, image) != VK_SUCCESS)
+        return create(device, info, allocator, image);
+
+    VkImageDrmFormatModifierPropertiesEXT properties = { .sType = VK_STRUCTURE_TYPE_IMAGE_DRM_FORMAT_MODIFIER_PROPERTIES_EXT };
+    VkSubresourceLayout layout = { 0 };
+    get_layout(device, *image, &(VkImageSubresource) { .aspectMask = VK_IMAGE_ASPECT_MEMORY_PLANE_0_BIT_EXT }, &layout);
+    if (get_modifier(device, *image, &properties) == VK_SUCCESS) {
+        session->images[session->image_count++] = (hook_image) {
+            .image = *image,
+            .width = info->extent.width,
+            .height = info->extent.height,
+            .modifier = properties.drmFormatModifier,
+            .offset = layout.offset,
+            .stride = layout.rowPitch
+        };
+    }
+    return VK_SUCCESS;
+}
+
+/**
+ * Rewrite the allocate info of memory that may back a capture image to be exportable as a DMA-BUF
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param session
+ *   Session slot with the images created with a modifier
+ * \param info
+ *   NvFBC's allocate info
+ * \param rewritten
+ *   Rewritten allocate info
+ *
+ * \return
+ *   True if the allocation was rewritten, false if it is left alone
+ */
+static bool rewrite_allocation(const hook_session* session, const VkMemoryAllocateInfo* info, hook_allocation_info* rewritten) {
+    *rewritten = (hook_allocation_info) { .info = *info };
+
+    // (only structures the hooks know how to copy, and only memory NvFBC exports itself)
+    bool has_export = false, has_dedicated = false, has_flags = false;
+    for (const VkBaseInStructure* next = info->pNext; next; next = next->pNext) {
+        if (next->sType == VK_STRUCTURE_TYPE_EXPORT_MEMORY_ALLOCATE_INFO) {
+            rewritten->export = *(const VkExportMemoryAllocateInfo*) next;
+            rewritten->export.handleTypes |= VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT;
+            has_export = true;
+        } else if (next->sType == VK_STRUCTURE_TYPE_MEMORY_DEDICATED_ALLOCATE_INFO) {
+            rewritten->dedicated = *(const VkMemoryDedicatedAllocateInfo*) next;
+            has_dedicated = true;
+        } else if (next->sType == VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_FLAGS_INFO) {
+            rewritten->flags = *(const VkMemoryAllocateFlagsInfo*) next;
+            has_flags = true;
+        } else {
+            return false;
+        }
+    }
+    if (!has_export)
+        return false;
+
+    // memory dedicated to an image without a modifier can't be shared as a DMA-BUF
+    bool known = !has_dedicated || !rewritten->dedicated.image;
+    for (int i = 0; i < session->image_count && !known; i++)
+        known = session->images[i].image == rewritten->dedicated.image;
+    if (!known)
+        return false;
+
+    const void** link = &rewritten->info.pNext;
+    *link = &rewritten->export;
+    link = &rewritten->export.pNext;
+    if (has_dedicated) {
+        *link = &rewritten->dedicated;
+        link = &rewritten->dedicated.pNext;
+    }
+    if (has_flags) {
+        *link = &rewritten->flags;
+        link = &rewritten->flags.pNext;
+    }
+    *link = NULL;
+    return true;
+}
+
+VkResult hooks_allocate_memory(hook_session* session, VkDevice device, const VkMemoryAllocateInfo* info, const VkAllocationCallbacks* allocator, VkDeviceMemory* memory,
+        PFN_vkAllocateMemory allocate) {
+    // only memory that may hold one of the session's images is changed
+    hook_allocation_info rewritten;
+    if (!session || !session->image_count || info->allocationSize < HOOKS_MIN_BUFFER_SIZE || !rewrite_allocation(session, info, &rewritten))
+        return allocate(device, info, allocator, memory);
+
+    if (allocate(device, &rewritten.info, allocator, memory) != VK_SUCCESS)
+        return allocate(device, info, allocator, memory);
+    return VK_SUCCESS;
+}
+
+void hooks_record_binding(hook_session* session, VkImage image, VkDeviceMemory memory, VkDeviceSize offset) {
+    for (int i = 0; i < session->image_count; i++) {
+        if (session->images[i].image != image)
+            continue;
+
+        for (int j = 0; j < NVFBC_TOGL_TEXTURES_MAX; j++) {
+            if (session->memory[j] != memory || j >= session->count)
+                continue;
+
+            session->bound[j] = session->images[i];
+            session->bound[j].offset += offset;
+        }
+        return;
+    }
+}
@@ -0,0 +1,35 @@
+#include "hooks.h"
+
+// stubs
+static char* glGetStringStub() { return "hewwo :3"; }
+static void* glStub() { return NULL; }
+static int glXStub() { return 1; }
+
+static const hook_symbol gl_hooks[] = {
+    HOOK_SYMBOL("glGetString", glGetStringStub, NULL)
+}; //!< OpenGL functions that don't return the generic stub
+
+/**
+ * Hook glXGetProcAddress to nullify NvFBCs OpenGL calls
+ *
+ * \author
+ *   0xNULLderef
+ *
+ * \param name
+ *   The name of the function to get
+ */
+static void* glXGetProcAddress_hook(const char* name) {
+    const hook_symbol* symbol = hooks_find(gl_hooks, HOOK_COUNT(gl_hooks), name);
+    return symbol ? symbol->hook : (void*) glStub;
+}
+
+void* hooks_glx_symbol(const char* name) {
+    static const hook_symbol glx_hooks[] = {
+        HOOK_SYMBOL("glXGetProcAddress", glXGetProcAddress_hook, NULL),
+        HOOK_SYMBOL("glXCreateNewContext", glXStub, NULL),
+        HOOK_SYMBOL("glXMakeCurrent", glXStub, NULL),
+        HOOK_SYMBOL("glXDestroyContext", glXStub, NULL)
+    };
+    const hook_symbol* symbol = hooks_find(glx_hooks, HOOK_COUNT(glx_hooks), name);
+    return symbol ? symbol->hook : NULL;
+}
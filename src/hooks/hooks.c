@@ -2,63 +2,186 @@
 #include "hooks.h"
 
 #include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <dlfcn.h>
 #include <link.h>
+#include <pthread.h>
 #include <vulkan/vulkan.h>
 
 #define GLX_NAME "libGLX.so.0"
 #define VK_NAME "libvulkan.so.1"
 #define GLX_SENTINEL_HANDLE ((void*) 1)
 #define VK_SENTINEL_HANDLE ((void*) 2)
+#define NVFBC_NAME "libnvidia-fbc"
+#define LOG_ENV "NVFBC_HOOKS_LOG"
+#define CALLER_CACHE_SIZE 256 //!< Number of return addresses remembered as not belonging to NvFBC
 
-// stubs
-char* glGetStringStub() { return "hewwo :3"; }
-void* glStub() { return NULL; }
-int glXStub() { return 1; }
+#define hook_log(...) do { if (log_enabled) fprintf(stderr, __VA_ARGS__); } while (0)
+
+static bool log_enabled; //!< Whether intercepted calls are logged to stderr (NVFBC_HOOKS_LOG is set)
+
+PFN_vkGetInstanceProcAddr vkGetInstanceProcAddr_real; //!< Real vkGetInstanceProcAddr function
+PFN_vkCreateDevice vkCreateDevice_real; //!< Real vkCreateDevice function
+PFN_vkDestroyDevice vkDestroyDevice_real; //!< Real vkDestroyDevice function
+PFN_vkAllocateMemory vkAllocateMemory_real; //!< Real vkAllocateMemory function
+PFN_vkFreeMemory vkFreeMemory_real; //!< Real vkFreeMemory function
+PFN_vkCreateImage vkCreateImage_real; //!< Real vkCreateImage function
+PFN_vkBindImageMemory vkBindImageMemory_real; //!< Real vkBindImageMemory function
+PFN_vkBindImageMemory2 vkBindImageMemory2_real; //!< Real vkBindImageMemory2 function
+PFN_vkBindImageMemory2 vkBindImageMemory2KHR_real; //!< Real vkBindImageMemory2KHR function
+
+NvFBCCustomState gstate; //!< Global state
+static __thread VkInstance current_instance; //!< Instance NvFBC last looked up functions of on this thread
+
+// slots of destroyed devices are reused, so the table is only touched with the lock held
+static pthread_mutex_t device_lock = PTHREAD_MUTEX_INITIALIZER; //!< Lock protecting the device table
+static hook_device devices[HOOKS_MAX_DEVICES]; //!< Devices created by NvFBC (VK_NULL_HANDLE for unused slots)
 
 /**
- * Hook glXGetProcAddress to nullify NvFBCs OpenGL calls
+ * Find a device created by NvFBC
  *
  * \author
- *   0xNULLderef
+ *   PancakeTAS
  *
- * \param name
- *   The name of the function to get
+ * \param device
+ *   Device
+ * \param entry
+ *   Copy of the device entry
+ *
+ * \return
+ *   True if the device is known, false otherwise
  */
-void* glXGetProcAddress_hook(const char* name) {
-    if (!strcmp(name, "glGetString"))
-        return glGetStringStub;
-    return glStub;
+static bool find_device(VkDevice device, hook_device* entry) {
+    bool found = false;
+    pthread_mutex_lock(&device_lock);
+    for (int i = 0; i < HOOKS_MAX_DEVICES && !found; i++) {
+        if (devices[i].device == device) {
+            *entry = devices[i];
+            found = true;
+        }
+    }
+    pthread_mutex_unlock(&device_lock);
+    return found;
 }
 
-PFN_vkGetInstanceProcAddr vkGetInstanceProcAddr_real; //!< Real vkGetInstanceProcAddr function
-PFN_vkCreateDevice vkCreateDevice_real; //!< Real vkCreateDevice function
-PFN_vkAllocateMemory vkAllocateMemory_real; //!< Real vkAllocateMemory function
+VkResult vkCreateDevice_hook(VkPhysicalDevice physicalDevice, const VkDeviceCreateInfo* pCreateInfo, const VkAllocationCallbacks* pAllocator, VkDevice* pDevice) {
+    // a device created while the plugin sets up a session gets the extensions for sharing the capture images
+    PFN_vkEnumerateDeviceExtensionProperties enumerate = (PFN_vkEnumerateDeviceExtensionProperties) vkGetInstanceProcAddr_real(current_instance, "vkEnumerateDeviceExtensionProperties");
+    uint32_t count = 0;
+    const char** names = hooks_device_extensions(hooks_recording_session(&gstate), physicalDevice, pCreateInfo, enumerate, &count);
+    VkResult res = VK_ERROR_INITIALIZATION_FAILED;
+    if (names) {
+        VkDeviceCreateInfo extended = *pCreateInfo;
+        extended.enabledExtensionCount = count;
+        extended.ppEnabledExtensionNames = names;
+        res = vkCreateDevice_real(physicalDevice, &extended, pAllocator, pDevice);
+        free(names);
+    }
+    bool modifiers = res == VK_SUCCESS;
+    if (!modifiers)
+        res = vkCreateDevice_real(physicalDevice, pCreateInfo, pAllocator, pDevice);
+    if (res != VK_SUCCESS)
+        return res;
 
-NvFBCCustomState gstate; //!< Global state
-int gstate_index = 0; //!< Index of the fd inside the global state
+    // remember which instance the device belongs to (until it is destroyed)
+    bool stored = false;
+    pthread_mutex_lock(&device_lock);
+    for (int i = 0; i < HOOKS_MAX_DEVICES && !stored; i++) {
+        if (devices[i].device == VK_NULL_HANDLE) {
+            devices[i] = (hook_device) { .device = *pDevice, .instance = current_instance, .modifiers = modifiers };
+            stored = true;
+        }
+    }
+    pthread_mutex_unlock(&device_lock);
+    if (!stored)
+        hook_log("nvfbc hooks: more than %d devices alive, device %p isn't tracked\n", HOOKS_MAX_DEVICES, (void*) *pDevice);
+    return res;
+}
 
-VkResult vkCreateDevice_hook(VkPhysicalDevice physicalDevice, const VkDeviceCreateInfo* pCreateInfo, const VkAllocationCallbacks* pAllocator, VkDevice* pDevice) {
-    VkResult res = vkCreateDevice_real(physicalDevice, pCreateInfo, pAllocator, pDevice);
-    gstate.device = *pDevice;
+void vkDestroyDevice_hook(VkDevice device, const VkAllocationCallbacks* pAllocator) {
+    // (the handle may come back for the next device)
+    pthread_mutex_lock(&device_lock);
+    for (int i = 0; i < HOOKS_MAX_DEVICES && device; i++) {
+        if (devices[i].device == device)
+            devices[i] = (hook_device) { 0 };
+    }
+    pthread_mutex_unlock(&device_lock);
+    vkDestroyDevice_real(device, pAllocator);
+}
+
+VkResult vkCreateImage_hook(VkDevice device, const VkImageCreateInfo* pCreateInfo, const VkAllocationCallbacks* pAllocator, VkImage* pImage) {
+    // only images made while the plugin sets up a session on this thread may hold captures
+    hook_device entry;
+    hook_session* session = find_device(device, &entry) && entry.modifiers ? hooks_recording_session(&gstate) : NULL;
+    if (!session)
+        return vkCreateImage_real(device, pCreateInfo, pAllocator, pImage);
+
+    PFN_vkGetImageDrmFormatModifierPropertiesEXT get_modifier = (PFN_vkGetImageDrmFormatModifierPropertiesEXT) vkGetInstanceProcAddr_real(entry.instance, "vkGetImageDrmFormatModifierPropertiesEXT");
+    PFN_vkGetImageSubresourceLayout get_layout = (PFN_vkGetImageSubresourceLayout) vkGetInstanceProcAddr_real(entry.instance, "vkGetImageSubresourceLayout");
+    return hooks_create_image(session, device, pCreateInfo, pAllocator, pImage, vkCreateImage_real, get_modifier, get_layout);
+}
+
+VkResult vkBindImageMemory_hook(VkDevice device, VkImage image, VkDeviceMemory memory, VkDeviceSize memoryOffset) {
+    VkResult res = vkBindImageMemory_real(device, image, memory, memoryOffset);
+    hook_session* session = res == VK_SUCCESS ? hooks_recording_session(&gstate) : NULL;
+    if (session)
+        hooks_record_binding(session, image, memory, memoryOffset);
+    return res;
+}
+
+/**
+ * Record the bindings of a vkBindImageMemory2 call
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param count
+ *   Number of bindings
+ * \param infos
+ *   Bindings
+ */
+static void record_bindings(uint32_t count, const VkBindImageMemoryInfo* infos) {
+    hook_session* session = hooks_recording_session(&gstate);
+    for (uint32_t i = 0; session && i < count; i++)
+        hooks_record_binding(session, infos[i].image, infos[i].memory, infos[i].memoryOffset);
+}
+
+VkResult vkBindImageMemory2_hook(VkDevice device, uint32_t bindInfoCount, const VkBindImageMemoryInfo* pBindInfos) {
+    VkResult res = vkBindImageMemory2_real(device, bindInfoCount, pBindInfos);
+    if (res == VK_SUCCESS)
+        record_bindings(bindInfoCount, pBindInfos);
+    return res;
+}
+
+VkResult vkBindImageMemory2KHR_hook(VkDevice device, uint32_t bindInfoCount, const VkBindImageMemoryInfo* pBindInfos) {
+    VkResult res = vkBindImageMemory2KHR_real(device, bindInfoCount, pBindInfos);
+    if (res == VK_SUCCESS)
+        record_bindings(bindInfoCount, pBindInfos);
     return res;
 }
 
 VkResult vkAllocateMemory_hook(VkDevice device, const VkMemoryAllocateInfo* pAllocateInfo, const VkAllocationCallbacks* pAllocator, VkDeviceMemory* pMemory) {
-    VkResult res = vkAllocateMemory_real(device, pAllocateInfo, pAllocator, pMemory);
-    if (pAllocateInfo->allocationSize > 10000) {
-        gstate.memory[gstate_index] = *pMemory;
-        gstate.size[gstate_index] = pAllocateInfo->allocationSize;
-        gstate_index++;
-
-        if (gstate_index == 2)
-            gstate_index = 0;
-    }
+    // only allocations made while the plugin sets up a session on this thread are its capture buffers
+    hook_session* session = pAllocateInfo->allocationSize >= HOOKS_MIN_BUFFER_SIZE ? hooks_recording_session(&gstate) : NULL;
+    hook_device entry = { 0 };
+    find_device(device, &entry);
+    VkResult res = hooks_allocate_memory(entry.modifiers ? session : NULL, device, pAllocateInfo, pAllocator, pMemory, vkAllocateMemory_real);
+    if (res != VK_SUCCESS || !session)
+        return res;
+
+    hooks_record_allocation(session, session->device ? session->instance : entry.instance, device, pAllocateInfo->allocationSize, *pMemory);
     return res;
 }
 
+void vkFreeMemory_hook(VkDevice device, VkDeviceMemory memory, const VkAllocationCallbacks* pAllocator) {
+    // (the handle may be reused by the next allocation, so the plugin drops its imports of it)
+    if (memory)
+        hooks_record_free(&gstate, memory);
+    vkFreeMemory_real(device, memory, pAllocator);
+}
+
 /**
  * Hook vkGetInstanceProcAddr to hack with Vulkan
  *
@@ -67,14 +190,23 @@ VkResult vkAllocateMemory_hook(VkDevice device, const VkMemoryAllocateInfo* pAll
  *
  */
 void* vkGetInstanceProcAddr_hook(VkInstance instance, const char* name) {
-    gstate.instance = instance;
-
-    if (!strcmp(name, "vkCreateDevice")) {
-        vkCreateDevice_real = (PFN_vkCreateDevice) vkGetInstanceProcAddr_real(instance, name);
-        return (void*) vkCreateDevice_hook;
-    } else if (!strcmp(name, "vkAllocateMemory")) {
-        vkAllocateMemory_real = (PFN_vkAllocateMemory) vkGetInstanceProcAddr_real(instance, name);
-        return (void*) vkAllocateMemory_hook;
+    if (instance)
+        current_instance = instance;
+
+    static const hook_symbol hooks[] = {
+        HOOK_SYMBOL("vkCreateDevice", vkCreateDevice_hook, &vkCreateDevice_real),
+        HOOK_SYMBOL("vkDestroyDevice", vkDestroyDevice_hook, &vkDestroyDevice_real),
+        HOOK_SYMBOL("vkAllocateMemory", vkAllocateMemory_hook, &vkAllocateMemory_real),
+        HOOK_SYMBOL("vkFreeMemory", vkFreeMemory_hook, &vkFreeMemory_real),
+        HOOK_SYMBOL("vkCreateImage", vkCreateImage_hook, &vkCreateImage_real),
+        HOOK_SYMBOL("vkBindImageMemory", vkBindImageMemory_hook, &vkBindImageMemory_real),
+        HOOK_SYMBOL("vkBindImageMemory2", vkBindImageMemory2_hook, &vkBindImageMemory2_real),
+        HOOK_SYMBOL("vkBindImageMemory2KHR", vkBindImageMemory2KHR_hook, &vkBindImageMemory2KHR_real)
+    };
+    const hook_symbol* symbol = hooks_find(hooks, HOOK_COUNT(hooks), name);
+    if (symbol) {
+        *symbol->real = (void*) vkGetInstanceProcAddr_real(instance, name);
+        return symbol->hook;
     }
 
     return vkGetInstanceProcAddr_real(instance, name);
@@ -94,6 +226,84 @@ dlclose_t dlclose_real; //!< Original dlclose function
 void* glxhandle_real; //!< Handle to the real libGLX.so.0
 void* vkhandle_real; //!< Handle to the real libvulkan.so.1
 
+static _Atomic uintptr_t nvfbc_start; //!< Start of libnvidia-fbc's loaded segments
+static _Atomic uintptr_t nvfbc_end; //!< End of libnvidia-fbc's loaded segments (0 until NvFBC first calls dlopen)
+static _Atomic uintptr_t other_callers[CALLER_CACHE_SIZE]; //!< Return addresses known not to belong to NvFBC, tagged with the cache generation (direct mapped)
+static _Atomic uintptr_t cache_generation; //!< Generation of other_callers, bumped whenever a library may have been unloaded
+
+/**
+ * Record the address range of libnvidia-fbc if it is the given object
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param info
+ *   Loaded object
+ *
+ * \return
+ *   1 if the range was recorded (stopping the iteration), 0 otherwise
+ */
+static int find_nvfbc(struct dl_phdr_info* info, size_t, void*) {
+    if (!info->dlpi_name || !strstr(info->dlpi_name, NVFBC_NAME))
+        return 0;
+
+    uintptr_t start = UINTPTR_MAX, end = 0;
+    for (int i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr)* phdr = &info->dlpi_phdr[i];
+        if (phdr->p_type != PT_LOAD)
+            continue;
+
+        uintptr_t segment = info->dlpi_addr + phdr->p_vaddr;
+        if (segment < start)
+            start = segment;
+        if (segment + phdr->p_memsz > end)
+            end = segment + phdr->p_memsz;
+    }
+    if (!end)
+        return 0;
+
+    atomic_store_explicit(&nvfbc_start, start, memory_order_relaxed);
+    atomic_store_explicit(&nvfbc_end, end, memory_order_release);
+    hook_log("nvfbc hooks: %s at %p-%p\n", info->dlpi_name, (void*) start, (void*) end);
+    return 1;
+}
+
+/**
+ * Check whether code at an address belongs to libnvidia-fbc
+ *
+ * Once NvFBC called, its address range classifies every caller. Until then,
+ * dladdr() runs once per call site and callers outside NvFBC are cached.
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param address
+ *   Return address of the caller
+ *
+ * \return
+ *   True if the caller is NvFBC, false otherwise
+ */
+static bool called_by_nvfbc(uintptr_t address) {
+    uintptr_t end = atomic_load_explicit(&nvfbc_end, memory_order_acquire);
+    if (end)
+        return address >= atomic_load_explicit(&nvfbc_start, memory_order_relaxed) && address < end;
+
+    // (entries of older generations may point into libraries that were unloaded, so they never match)
+    uintptr_t tagged = address ^ atomic_load_explicit(&cache_generation, memory_order_relaxed) * (uintptr_t) 0x9E3779B97F4A7C15ULL;
+    _Atomic uintptr_t* cached = &other_callers[(address ^ address >> 12) % CALLER_CACHE_SIZE];
+    if (atomic_load_explicit(cached, memory_order_relaxed) == tagged)
+        return false;
+
+    Dl_info info;
+    if (!dladdr((void*) address, &info) || !info.dli_fname || !strstr(info.dli_fname, NVFBC_NAME)) {
+        atomic_store_explicit(cached, tagged, memory_order_relaxed);
+        return false;
+    }
+
+    dl_iterate_phdr(find_nvfbc, NULL);
+    return true;
+}
+
 /**
  * Initialize the hooking mechanism
  *
@@ -104,6 +314,7 @@ void dl_hook_init() {
     if (dlopen_real)
         return;
 
+    log_enabled = getenv(LOG_ENV) != NULL;
     dlopen_real = (dlopen_t)dlvsym(RTLD_NEXT, "dlopen", "GLIBC_2.2.5");
     dlsym_real = (dlsym_t)dlvsym(RTLD_NEXT, "dlsym", "GLIBC_2.2.5");
     dlclose_real = (dlclose_t)dlvsym(RTLD_NEXT, "dlclose", "GLIBC_2.2.5");
@@ -123,14 +334,11 @@ void dl_hook_init() {
 void* dlopen(const char* file, int mode) {
     dl_hook_init();
 
-    // check if call is from nvfbc
-    void* ret = __builtin_extract_return_addr(__builtin_return_address(0));
-    Dl_info info;
-    dladdr(ret, &info);
-    if (!strstr(info.dli_fname, "libnvidia-fbc")) {
+    // only NvFBC's own calls are redirected
+    uintptr_t caller = (uintptr_t) __builtin_extract_return_addr(__builtin_return_address(0));
+    if (!called_by_nvfbc(caller))
         return dlopen_real(file, mode);
-    }
-    printf("\ndlopen on %s\n", file);
+    hook_log("nvfbc hooks: dlopen on %s\n", file);
 
     if (file && !strcmp(GLX_NAME, file)) {
         glxhandle_real = dlopen_real(file, mode);
@@ -156,23 +364,25 @@ void* dlopen(const char* file, int mode) {
  */
 void* dlsym(void* handle, const char* name) {
     dl_hook_init();
-    if (handle == GLX_SENTINEL_HANDLE) {
-        printf("\ndlsym on %p %s\n", handle, name);
-        if (!strcmp(name, "glXGetProcAddress"))
-            return glXGetProcAddress_hook;
-        else if (!strcmp(name, "glXCreateNewContext") || !strcmp(name, "glXMakeCurrent") || !strcmp(name, "glXDestroyContext"))
-            return glXStub;
-        return dlsym_real(glxhandle_real, name);
-    } else if (handle == VK_SENTINEL_HANDLE) {
-        printf("\ndlsym on %p %s\n", handle, name);
-        if (!strcmp(name, "vkGetInstanceProcAddr")) {
-            vkGetInstanceProcAddr_real = (PFN_vkGetInstanceProcAddr) dlsym_real(vkhandle_real, name);
-            return vkGetInstanceProcAddr_hook;
-        }
-        return dlsym_real(vkhandle_real, name);
-    } else {
+    if (handle != GLX_SENTINEL_HANDLE && handle != VK_SENTINEL_HANDLE)
         return dlsym_real(handle, name);
+
+    static const hook_symbol vk_hooks[] = {
+        HOOK_SYMBOL("vkGetInstanceProcAddr", vkGetInstanceProcAddr_hook, &vkGetInstanceProcAddr_real)
+    };
+
+    hook_log("nvfbc hooks: dlsym on %p %s\n", handle, name);
+    if (handle == GLX_SENTINEL_HANDLE) {
+        void* stub = hooks_glx_symbol(name);
+        return stub ? stub : dlsym_real(glxhandle_real, name);
     }
+
+    const hook_symbol* symbol = hooks_find(vk_hooks, HOOK_COUNT(vk_hooks), name);
+    if (!symbol)
+        return dlsym_real(vkhandle_real, name);
+
+    *symbol->real = dlsym_real(vkhandle_real, name);
+    return symbol->hook;
 }
 
 /**
@@ -191,6 +401,8 @@ int dlclose(void* handle) {
     } else if (handle == VK_SENTINEL_HANDLE) {
         return dlclose_real(vkhandle_real);
     } else {
+        if (!atomic_load_explicit(&nvfbc_end, memory_order_relaxed))
+            atomic_fetch_add_explicit(&cache_generation, 1, memory_order_relaxed);
         return dlclose_real(handle);
     }
 }
\ No newline at end of file
@@ -2,13 +2,292 @@
 
 #include <vulkan/vulkan.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
 #include <NvFBC.h>
 
+#define HOOKS_MAX_DEVICES 32 //!< Maximum number of Vulkan devices the preload hooks track at once
+#define HOOKS_MAX_SESSIONS 16 //!< Maximum number of NvFBC sessions recording or holding buffers at once
+#define HOOKS_MIN_BUFFER_SIZE 10000 //!< Allocations smaller than this are never capture buffers
+#define HOOKS_FREED_HISTORY 64 //!< Number of freed allocations remembered, imports older than the history are treated as freed
+#define HOOKS_MAX_MODIFIERS 32 //!< Maximum number of DRM format modifiers offered for NvFBC's capture images
+#define HOOKS_MAX_IMAGES 8 //!< Maximum number of images created with a modifier per session
+#define HOOKS_MODIFIER_EXTENSIONS 3 //!< Number of device extensions the hooks may add for images with modifiers
+
+#define HOOKS_LAYER_NAME "VK_LAYER_NVFBC_capture" //!< Name of the (explicit) Vulkan layer, enabled only on NvFBC's instance
+#define HOOKS_LAYER_STATE_SYMBOL "nvfbc_layer_state" //!< Symbol of the plugin pointing at the state the Vulkan layer records into
+#define HOOKS_PLUGIN_NAME "obs-nvfbc" //!< Start of the file name of the plugin, which the Vulkan layer looks the state up in
+
+#define HOOK_SYMBOL(name, hook, real) { name, sizeof(name) - 1, (void*) (hook), (void**) (real) }
+#define HOOK_COUNT(table) (sizeof(table) / sizeof((table)[0]))
+
+typedef struct {
+    const char* name; //!< Name of the symbol
+    size_t length; //!< Length of the name
+    void* hook; //!< Function returned instead of the real one
+    void** real; //!< Where to store the real function (may be NULL)
+} hook_symbol; //!< Symbol replaced by a hook
+
+typedef enum {
+    HOOK_SESSION_FREE, //!< Slot is unused
+    HOOK_SESSION_CLAIMED, //!< Slot is being prepared by the plugin
+    HOOK_SESSION_RECORDING, //!< Allocations of the owner thread are recorded into the slot
+    HOOK_SESSION_RECORDED //!< Recording finished, the buffers can be read without synchronization
+} hook_session_state; //!< State of a session slot
+
+typedef struct {
+    VkDevice device; //!< Device (VK_NULL_HANDLE for unused entries)
+    VkInstance instance; //!< Instance the device was created from
+    bool modifiers; //!< Whether the device was created with the extensions for images with modifiers
+} hook_device; //!< Vulkan device created by NvFBC
+
+typedef struct {
+    VkImage image; //!< Image (VK_NULL_HANDLE if the buffer holds no image with a modifier)
+    uint32_t width, height; //!< Size of the image
+    uint64_t modifier; //!< DRM format modifier the driver picked for the image
+    uint64_t offset; //!< Offset of the image in its memory
+    uint64_t stride; //!< Bytes per row of the image
+} hook_image; //!< Image NvFBC created with a DRM format modifier
+
+typedef struct {
+    VkImageCreateInfo info; //!< NvFBC's create info with modifier tiling
+    VkImageDrmFormatModifierListCreateInfoEXT modifiers; //!< Modifiers the driver may pick from
+    VkExternalMemoryImageCreateInfo external; //!< NvFBC's handle types with DMA-BUFs added
+    VkImageFormatListCreateInfo formats; //!< Copy of NvFBC's view formats (if it passed any)
+} hook_image_info; //!< Create info of a capture image, rewritten to use a modifier
+
+typedef struct {
+    VkMemoryAllocateInfo info; //!< NvFBC's allocate info
+    VkExportMemoryAllocateInfo export; //!< NvFBC's handle types with DMA-BUFs added
+    VkMemoryDedicatedAllocateInfo dedicated; //!< Copy of NvFBC's dedicated allocation (if it made one)
+    VkMemoryAllocateFlagsInfo flags; //!< Copy of NvFBC's allocation flags (if it passed any)
+} hook_allocation_info; //!< Allocate info of a capture buffer, rewritten to be exportable as a DMA-BUF
+
 typedef struct {
-    VkInstance instance;
-    VkDevice device;
-    VkDeviceMemory memory[2];
-    uint64_t size[2];
-} NvFBCCustomState;
+    atomic_int state; //!< State of the slot (see hook_session_state)
+    pthread_t owner; //!< Thread setting up the NvFBC session (valid while recording)
+    VkInstance instance; //!< Instance of the device holding the buffers
+    VkDevice device; //!< Device holding the buffers
+    VkDeviceMemory memory[NVFBC_TOGL_TEXTURES_MAX]; //!< Capture buffers, the most recent allocations of the session
+    uint64_t size[NVFBC_TOGL_TEXTURES_MAX]; //!< Sizes of the capture buffers
+    int count; //!< Number of large allocations seen while recording
+    uint64_t modifiers[HOOKS_MAX_MODIFIERS]; //!< DRM format modifiers the plugin can import, NvFBC's capture images are created with one of them
+    int modifier_count; //!< Number of modifiers (0 leaves NvFBC's images alone)
+    hook_image images[HOOKS_MAX_IMAGES]; //!< Images created with a modifier while recording
+    int image_count; //!< Number of images created with a modifier
+    hook_image bound[NVFBC_TOGL_TEXTURES_MAX]; //!< Image with a modifier bound to each capture buffer
+} hook_session; //!< Capture buffers of one NvFBC session
+
+typedef struct {
+    atomic_uint_fast64_t number; //!< Number of the free plus one (0 while the slot is written)
+    atomic_uint_fast64_t memory; //!< Freed allocation
+} hook_free; //!< Allocation NvFBC freed
+
+typedef struct {
+    hook_session sessions[HOOKS_MAX_SESSIONS]; //!< Session slots
+    atomic_uint_fast64_t frees; //!< Number of device memory allocations freed
+    hook_free freed[HOOKS_FREED_HISTORY]; //!< Most recently freed allocations, indexed by their number modulo the history size
+} NvFBCCustomState; //!< State shared between the preload hooks (or the Vulkan layer) and the plugin
 
 extern NvFBCCustomState gstate;
+
+/**
+ * Find the hook replacing a symbol
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param table
+ *   Hooked symbols
+ * \param count
+ *   Number of hooked symbols
+ * \param name
+ *   Name of the symbol
+ *
+ * \return
+ *   Hooked symbol, or NULL if the symbol isn't hooked
+ */
+const hook_symbol* hooks_find(const hook_symbol* table, size_t count, const char* name);
+
+/**
+ * Return the stub replacing a GLX function NvFBC looks up
+ *
+ * \author
+ *   0xNULLderef
+ *
+ * \param name
+ *   Name of the GLX function
+ *
+ * \return
+ *   Stub, or NULL if NvFBC gets the real function
+ */
+void* hooks_glx_symbol(const char* name);
+
+/**
+ * Find the session slot recording allocations of the calling thread
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param state
+ *   Hook state
+ *
+ * \return
+ *   Session slot, or NULL if the thread isn't setting up a session
+ */
+hook_session* hooks_recording_session(NvFBCCustomState* state);
+
+/**
+ * Record a large allocation into a recording session slot
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param session
+ *   Session slot recording the calling thread
+ * \param instance
+ *   Instance of the device
+ * \param device
+ *   Device the memory was allocated from
+ * \param size
+ *   Size of the allocation
+ * \param memory
+ *   Allocated memory
+ */
+void hooks_record_allocation(hook_session* session, VkInstance instance, VkDevice device, VkDeviceSize size, VkDeviceMemory memory);
+
+/**
+ * Record that NvFBC freed an allocation
+ *
+ * Must be called before the real vkFreeMemory, the handle may be reused right after it.
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param state
+ *   Hook state
+ * \param memory
+ *   Freed memory
+ */
+void hooks_record_free(NvFBCCustomState* state, VkDeviceMemory memory);
+
+/**
+ * Check whether an allocation was freed since an earlier check
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param state
+ *   Hook state
+ * \param memory
+ *   Memory to look for
+ * \param since
+ *   Number of frees already checked, advanced past the frees that were looked at
+ *
+ * \return
+ *   True if the memory was freed (or the history doesn't reach back far enough to tell), false otherwise
+ */
+bool hooks_freed_since(NvFBCCustomState* state, VkDeviceMemory memory, uint64_t* since);
+
+/**
+ * List the extensions NvFBC's device needs for images with modifiers, if it supports them
+ *
+ * The device is created with the list, and with NvFBC's own create info if that fails.
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param session
+ *   Session slot recording the calling thread (NULL to leave the device alone)
+ * \param physical_device
+ *   Physical device
+ * \param info
+ *   NvFBC's create info
+ * \param enumerate
+ *   vkEnumerateDeviceExtensionProperties of the physical device
+ * \param count
+ *   Number of extensions in the list
+ *
+ * \return
+ *   NvFBC's extensions followed by the missing ones (free() it), or NULL if the device is left alone
+ */
+const char** hooks_device_extensions(hook_session* session, VkPhysicalDevice physical_device, const VkDeviceCreateInfo* info,
+    PFN_vkEnumerateDeviceExtensionProperties enumerate, uint32_t* count);
+
+/**
+ * Create one of NvFBC's images, with one of the session's modifiers if it can hold a capture
+ *
+ * The driver picks the modifier from the list, the hooks record which one it
+ * picked and how the image is laid out. Falls back to NvFBC's own create info
+ * if the image can't be created with a modifier.
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param session
+ *   Session slot recording the calling thread (NULL to leave the image alone)
+ * \param device
+ *   Device created with the modifier extensions
+ * \param info
+ *   NvFBC's create info
+ * \param allocator
+ *   NvFBC's allocator
+ * \param image
+ *   Created image
+ * \param create
+ *   vkCreateImage to call
+ * \param get_modifier
+ *   vkGetImageDrmFormatModifierPropertiesEXT of the device
+ * \param get_layout
+ *   vkGetImageSubresourceLayout of the device
+ *
+ * \return
+ *   Result of vkCreateImage
+ */
+VkResult hooks_create_image(hook_session* session, VkDevice device, const VkImageCreateInfo* info, const VkAllocationCallbacks* allocator, VkImage* image,
+    PFN_vkCreateImage create, PFN_vkGetImageDrmFormatModifierPropertiesEXT get_modifier, PFN_vkGetImageSubresourceLayout get_layout);
+
+/**
+ * Allocate NvFBC's memory, exportable as a DMA-BUF if it may back a capture image with a modifier
+ *
+ * Falls back to NvFBC's own allocate info if the memory can't be exported as a DMA-BUF.
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param session
+ *   Session slot recording the calling thread (NULL to leave the allocation alone)
+ * \param device
+ *   Device created with the modifier extensions
+ * \param info
+ *   NvFBC's allocate info
+ * \param allocator
+ *   NvFBC's allocator
+ * \param memory
+ *   Allocated memory
+ * \param allocate
+ *   vkAllocateMemory to call
+ *
+ * \return
+ *   Result of vkAllocateMemory
+ */
+VkResult hooks_allocate_memory(hook_session* session, VkDevice device, const VkMemoryAllocateInfo* info, const VkAllocationCallbacks* allocator, VkDeviceMemory* memory,
+    PFN_vkAllocateMemory allocate);
+
+/**
+ * Record that an image was bound to memory, so a capture buffer knows the modifier of its image
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param session
+ *   Session slot recording the calling thread
+ * \param image
+ *   Bound image
+ * \param memory
+ *   Memory the image was bound to
+ * \param offset
+ *   Offset of the image in the memory
+ */
+void hooks_record_binding(hook_session* session, VkImage image, VkDeviceMemory memory, VkDeviceSize offset);
@@ -0,0 +1,454 @@
+#define _GNU_SOURCE
+#include "hooks.h"
+
+#include <vulkan/vulkan.h>
+#include <vulkan/vk_layer.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#include <link.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#define dispatch_key(handle) (*(void**) (handle)) //!< Loader dispatch table of a dispatchable handle (shared by an instance and its physical devices)
+
+typedef struct layer_instance {
+    _Atomic(void*) key; //!< Dispatch key of the instance (published last, NULL if the entry is unused)
+    VkInstance instance; //!< Instance
+    PFN_vkGetInstanceProcAddr next_proc_addr; //!< vkGetInstanceProcAddr of the next layer
+    PFN_vkDestroyInstance destroy; //!< vkDestroyInstance of the next layer
+    struct layer_instance* next; //!< Next entry
+} layer_instance; //!< Instance created through the layer
+
+typedef struct layer_device {
+    _Atomic(void*) key; //!< Dispatch key of the device (published last, NULL if the entry is unused)
+    VkInstance instance; //!< Instance the device was created from
+    PFN_vkGetDeviceProcAddr next_proc_addr; //!< vkGetDeviceProcAddr of the next layer
+    PFN_vkDestroyDevice destroy; //!< vkDestroyDevice of the next layer
+    PFN_vkAllocateMemory allocate; //!< vkAllocateMemory of the next layer
+    PFN_vkFreeMemory free; //!< vkFreeMemory of the next layer
+    PFN_vkCreateImage create_image; //!< vkCreateImage of the next layer
+    PFN_vkBindImageMemory bind; //!< vkBindImageMemory of the next layer
+    PFN_vkBindImageMemory2 bind2; //!< vkBindImageMemory2 (or vkBindImageMemory2KHR) of the next layer
+    PFN_vkGetImageDrmFormatModifierPropertiesEXT get_modifier; //!< vkGetImageDrmFormatModifierPropertiesEXT of the next layer (NULL without modifiers)
+    PFN_vkGetImageSubresourceLayout get_layout; //!< vkGetImageSubresourceLayout of the next layer
+    bool modifiers; //!< Whether the device was created with the extensions for images with modifiers
+    struct layer_device* next; //!< Next entry
+} layer_device; //!< Device created through the layer
+
+// entries are never freed, unused ones are reused, so lookups walk the lists without a lock
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER; //!< Lock serializing creation and destruction of instances and devices
+static _Atomic(layer_instance*) instances; //!< Instances created through the layer
+static _Atomic(layer_device*) devices; //!< Devices created through the layer
+static _Atomic(NvFBCCustomState*) state; //!< State of the plugin in this process (NULL if the plugin didn't publish one)
+
+/**
+ * Remember the path of the plugin if an object is it
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param info
+ *   Loaded object
+ * \param data
+ *   Path to fill (PATH_MAX bytes)
+ *
+ * \return
+ *   1 once the plugin was found, 0 to keep looking
+ */
+static int find_plugin(struct dl_phdr_info* info, size_t, void* data) {
+    const char* name = strrchr(info->dlpi_name, '/');
+    name = name ? name + 1 : info->dlpi_name;
+    if (strncmp(name, HOOKS_PLUGIN_NAME, strlen(HOOKS_PLUGIN_NAME)))
+        return 0;
+
+    snprintf((char*) data, PATH_MAX, "%s", info->dlpi_name);
+    return 1;
+}
+
+/**
+ * Find the state the plugin published in this process
+ *
+ * OBS loads plugins locally, so the symbol is looked up in the plugin itself
+ * (the loader lock is held while objects are iterated, so it is opened after).
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \return
+ *   Hook state, or NULL if there is none
+ */
+static NvFBCCustomState* find_state() {
+    // (programs linking the state in, like the layer check, export it globally)
+    _Atomic(NvFBCCustomState*)* published = dlsym(RTLD_DEFAULT, HOOKS_LAYER_STATE_SYMBOL);
+    if (!published) {
+        char path[PATH_MAX] = "";
+        dl_iterate_phdr(find_plugin, path);
+        void* plugin = path[0] ? dlopen(path, RTLD_LAZY | RTLD_NOLOAD) : NULL;
+        if (plugin) {
+            published = dlsym(plugin, HOOKS_LAYER_STATE_SYMBOL);
+            dlclose(plugin);
+        }
+    }
+    return published ? atomic_load_explicit(published, memory_order_acquire) : NULL;
+}
+
+/**
+ * Find an instance by its dispatch key (unused entries are only looked up with the lock held)
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param key
+ *   Dispatch key of the instance or one of its physical devices
+ *
+ * \return
+ *   Instance entry, or NULL if the instance is unknown
+ */
+static layer_instance* find_instance(void* key) {
+    for (layer_instance* entry = atomic_load_explicit(&instances, memory_order_acquire); entry; entry = entry->next) {
+        if (atomic_load_explicit(&entry->key, memory_order_acquire) == key)
+            return entry;
+    }
+    return NULL;
+}
+
+/**
+ * Find a device by its dispatch key (unused entries are only looked up with the lock held)
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param key
+ *   Dispatch key of the device
+ *
+ * \return
+ *   Device entry, or NULL if the device is unknown
+ */
+static layer_device* find_device(void* key) {
+    for (layer_device* entry = atomic_load_explicit(&devices, memory_order_acquire); entry; entry = entry->next) {
+        if (atomic_load_explicit(&entry->key, memory_order_acquire) == key)
+            return entry;
+    }
+    return NULL;
+}
+
+/**
+ * Take an unused instance entry, or add a new one (call with the lock held)
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \return
+ *   Unused entry, or NULL if it couldn't be allocated
+ */
+static layer_instance* take_instance() {
+    layer_instance* entry = find_instance(NULL);
+    if (entry)
+        return entry;
+
+    entry = calloc(1, sizeof(layer_instance));
+    if (!entry)
+        return NULL;
+    entry->next = atomic_load_explicit(&instances, memory_order_relaxed);
+    atomic_store_explicit(&instances, entry, memory_order_release);
+    return entry;
+}
+
+/**
+ * Take an unused device entry, or add a new one (call with the lock held)
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \return
+ *   Unused entry, or NULL if it couldn't be allocated
+ */
+static layer_device* take_device() {
+    layer_device* entry = find_device(NULL);
+    if (entry)
+        return entry;
+
+    entry = calloc(1, sizeof(layer_device));
+    if (!entry)
+        return NULL;
+    entry->next = atomic_load_explicit(&devices, memory_order_relaxed);
+    atomic_store_explicit(&devices, entry, memory_order_release);
+    return entry;
+}
+
+static VkResult layer_CreateInstance(const VkInstanceCreateInfo* pCreateInfo, const VkAllocationCallbacks* pAllocator, VkInstance* pInstance) {
+    VkLayerInstanceCreateInfo* chain = (VkLayerInstanceCreateInfo*) pCreateInfo->pNext;
+    while (chain && !(chain->sType == VK_STRUCTURE_TYPE_LOADER_INSTANCE_CREATE_INFO && chain->function == VK_LAYER_LINK_INFO))
+        chain = (VkLayerInstanceCreateInfo*) chain->pNext;
+    if (!chain)
+        return VK_ERROR_INITIALIZATION_FAILED;
+
+    // advance the chain for the next layer
+    PFN_vkGetInstanceProcAddr next_proc_addr = chain->u.pLayerInfo->pfnNextGetInstanceProcAddr;
+    chain->u.pLayerInfo = chain->u.pLayerInfo->pNext;
+    PFN_vkCreateInstance create = (PFN_vkCreateInstance) next_proc_addr(VK_NULL_HANDLE, "vkCreateInstance");
+    VkResult res = create(pCreateInfo, pAllocator, pInstance);
+    if (res != VK_SUCCESS)
+        return res;
+
+    PFN_vkDestroyInstance destroy = (PFN_vkDestroyInstance) next_proc_addr(*pInstance, "vkDestroyInstance");
+    pthread_mutex_lock(&lock);
+    if (!atomic_load_explicit(&state, memory_order_relaxed))
+        atomic_store_explicit(&state, find_state(), memory_order_release);
+    layer_instance* entry = take_instance();
+    if (entry) {
+        entry->instance = *pInstance;
+        entry->next_proc_addr = next_proc_addr;
+        entry->destroy = destroy;
+        atomic_store_explicit(&entry->key, dispatch_key(*pInstance), memory_order_release);
+    }
+    pthread_mutex_unlock(&lock);
+
+    if (!entry) {
+        destroy(*pInstance, pAllocator);
+        return VK_ERROR_OUT_OF_HOST_MEMORY;
+    }
+    return res;
+}
+
+static void layer_DestroyInstance(VkInstance instance, const VkAllocationCallbacks* pAllocator) {
+    if (!instance)
+        return;
+
+    pthread_mutex_lock(&lock);
+    layer_instance* entry = find_instance(dispatch_key(instance));
+    PFN_vkDestroyInstance destroy = entry ? entry->destroy : NULL;
+    if (entry)
+        atomic_store_explicit(&entry->key, NULL, memory_order_release);
+    pthread_mutex_unlock(&lock);
+
+    if (destroy)
+        destroy(instance, pAllocator);
+}
+
+static VkResult layer_CreateDevice(VkPhysicalDevice physicalDevice, const VkDeviceCreateInfo* pCreateInfo, const VkAllocationCallbacks* pAllocator, VkDevice* pDevice) {
+    VkLayerDeviceCreateInfo* chain = (VkLayerDeviceCreateInfo*) pCreateInfo->pNext;
+    while (chain && !(chain->sType == VK_STRUCTURE_TYPE_LOADER_DEVICE_CREATE_INFO && chain->function == VK_LAYER_LINK_INFO))
+        chain = (VkLayerDeviceCreateInfo*) chain->pNext;
+    if (!chain)
+        return VK_ERROR_INITIALIZATION_FAILED;
+
+    // advance the chain for the next layer
+    PFN_vkGetInstanceProcAddr next_instance_proc_addr = chain->u.pLayerInfo->pfnNextGetInstanceProcAddr;
+    PFN_vkGetDeviceProcAddr next_proc_addr = chain->u.pLayerInfo->pfnNextGetDeviceProcAddr;
+    chain->u.pLayerInfo = chain->u.pLayerInfo->pNext;
+
+    layer_instance* parent = find_instance(dispatch_key(physicalDevice));
+    VkInstance instance = parent ? parent->instance : VK_NULL_HANDLE;
+
+    // a device created while the plugin sets up a session gets the extensions for sharing the capture images
+    PFN_vkCreateDevice create = (PFN_vkCreateDevice) next_instance_proc_addr(instance, "vkCreateDevice");
+    PFN_vkEnumerateDeviceExtensionProperties enumerate = (PFN_vkEnumerateDeviceExtensionProperties) next_instance_proc_addr(instance, "vkEnumerateDeviceExtensionProperties");
+    NvFBCCustomState* hooks = atomic_load_explicit(&state, memory_order_acquire);
+    uint32_t count = 0;
+    const char** names = hooks_device_extensions(hooks ? hooks_recording_session(hooks) : NULL, physicalDevice, pCreateInfo, enumerate, &count);
+    VkResult res = VK_ERROR_INITIALIZATION_FAILED;
+    const VkLayerDeviceLink* link = chain->u.pLayerInfo;
+    if (names) {
+        VkDeviceCreateInfo extended = *pCreateInfo;
+        extended.enabledExtensionCount = count;
+        extended.ppEnabledExtensionNames = names;
+        res = create(physicalDevice, &extended, pAllocator, pDevice);
+        free(names);
+    }
+
+    // (the next layer advances the chain again, so it is rewound before NvFBC's own create info is tried)
+    bool modifiers = res == VK_SUCCESS;
+    if (!modifiers) {
+        chain->u.pLayerInfo = (VkLayerDeviceLink*) link;
+        res = create(physicalDevice, pCreateInfo, pAllocator, pDevice);
+    }
+    if (res != VK_SUCCESS)
+        return res;
+
+    PFN_vkDestroyDevice destroy = (PFN_vkDestroyDevice) next_proc_addr(*pDevice, "vkDestroyDevice");
+    pthread_mutex_lock(&lock);
+    layer_device* entry = take_device();
+    if (entry) {
+        entry->instance = instance;
+        entry->next_proc_addr = next_proc_addr;
+        entry->destroy = destroy;
+        entry->allocate = (PFN_vkAllocateMemory) next_proc_addr(*pDevice, "vkAllocateMemory");
+        entry->free = (PFN_vkFreeMemory) next_proc_addr(*pDevice, "vkFreeMemory");
+        entry->create_image = (PFN_vkCreateImage) next_proc_addr(*pDevice, "vkCreateImage");
+        entry->bind = (PFN_vkBindImageMemory) next_proc_addr(*pDevice, "vkBindImageMemory");
+        entry->bind2 = (PFN_vkBindImageMemory2) next_proc_addr(*pDevice, "vkBindImageMemory2");
+        if (!entry->bind2)
+            entry->bind2 = (PFN_vkBindImageMemory2) next_proc_addr(*pDevice, "vkBindImageMemory2KHR");
+        entry->get_modifier = modifiers ? (PFN_vkGetImageDrmFormatModifierPropertiesEXT) next_proc_addr(*pDevice, "vkGetImageDrmFormatModifierPropertiesEXT") : NULL;
+        entry->get_layout = (PFN_vkGetImageSubresourceLayout) next_proc_addr(*pDevice, "vkGetImageSubresourceLayout");
+        entry->modifiers = modifiers;
+        atomic_store_explicit(&entry->key, dispatch_key(*pDevice), memory_order_release);
+    }
+    pthread_mutex_unlock(&lock);
+
+    if (!entry) {
+        destroy(*pDevice, pAllocator);
+        return VK_ERROR_OUT_OF_HOST_MEMORY;
+    }
+    return res;
+}
+
+static void layer_DestroyDevice(VkDevice device, const VkAllocationCallbacks* pAllocator) {
+    if (!device)
+        return;
+
+    pthread_mutex_lock(&lock);
+    layer_device* entry = find_device(dispatch_key(device));
+    PFN_vkDestroyDevice destroy = entry ? entry->destroy : NULL;
+    if (entry)
+        atomic_store_explicit(&entry->key, NULL, memory_order_release);
+    pthread_mutex_unlock(&lock);
+
+    if (destroy)
+        destroy(device, pAllocator);
+}
+
+static VkResult layer_AllocateMemory(VkDevice device, const VkMemoryAllocateInfo* pAllocateInfo, const VkAllocationCallbacks* pAllocator, VkDeviceMemory* pMemory) {
+    layer_device* entry = find_device(dispatch_key(device));
+    if (!entry)
+        return VK_ERROR_INITIALIZATION_FAILED;
+
+    // only allocations made while the plugin sets up a session on this thread are NvFBC's capture buffers
+    NvFBCCustomState* hooks = atomic_load_explicit(&state, memory_order_acquire);
+    hook_session* session = hooks && pAllocateInfo->allocationSize >= HOOKS_MIN_BUFFER_SIZE ? hooks_recording_session(hooks) : NULL;
+    VkResult res = hooks_allocate_memory(entry->modifiers ? session : NULL, device, pAllocateInfo, pAllocator, pMemory, entry->allocate);
+    if (res == VK_SUCCESS && session)
+        hooks_record_allocation(session, entry->instance, device, pAllocateInfo->allocationSize, *pMemory);
+    return res;
+}
+
+static VkResult layer_CreateImage(VkDevice device, const VkImageCreateInfo* pCreateInfo, const VkAllocationCallbacks* pAllocator, VkImage* pImage) {
+    layer_device* entry = find_device(dispatch_key(device));
+    if (!entry)
+        return VK_ERROR_INITIALIZATION_FAILED;
+
+    // only images made while the plugin sets up a session on this thread may hold captures
+    NvFBCCustomState* hooks = atomic_load_explicit(&state, memory_order_acquire);
+    hook_session* session = entry->modifiers && hooks ? hooks_recording_session(hooks) : NULL;
+    return hooks_create_image(session, device, pCreateInfo, pAllocator, pImage, entry->create_image, entry->get_modifier, entry->get_layout);
+}
+
+static VkResult layer_BindImageMemory(VkDevice device, VkImage image, VkDeviceMemory memory, VkDeviceSize memoryOffset) {
+    layer_device* entry = find_device(dispatch_key(device));
+    if (!entry)
+        return VK_ERROR_INITIALIZATION_FAILED;
+
+    VkResult res = entry->bind(device, image, memory, memoryOffset);
+    NvFBCCustomState* hooks = atomic_load_explicit(&state, memory_order_acquire);
+    hook_session* session = res == VK_SUCCESS && entry->modifiers && hooks ? hooks_recording_session(hooks) : NULL;
+    if (session)
+        hooks_record_binding(session, image, memory, memoryOffset);
+    return res;
+}
+
+static VkResult layer_BindImageMemory2(VkDevice device, uint32_t bindInfoCount, const VkBindImageMemoryInfo* pBindInfos) {
+    layer_device* entry = find_device(dispatch_key(device));
+    if (!entry || !entry->bind2)
+        return VK_ERROR_INITIALIZATION_FAILED;
+
+    VkResult res = entry->bind2(device, bindInfoCount, pBindInfos);
+    NvFBCCustomState* hooks = atomic_load_explicit(&state, memory_order_acquire);
+    hook_session* session = res == VK_SUCCESS && entry->modifiers && hooks ? hooks_recording_session(hooks) : NULL;
+    for (uint32_t i = 0; session && i < bindInfoCount; i++)
+        hooks_record_binding(session, pBindInfos[i].image, pBindInfos[i].memory, pBindInfos[i].memoryOffset);
+    return res;
+}
+
+static void layer_FreeMemory(VkDevice device, VkDeviceMemory memory, const VkAllocationCallbacks* pAllocator) {
+    layer_device* entry = find_device(dispatch_key(device));
+    if (!entry)
+        return;
+
+    // (the handle may be reused by the next allocation, so the plugin drops its imports of it)
+    NvFBCCustomState* hooks = atomic_load_explicit(&state, memory_order_acquire);
+    if (memory && hooks)
+        hooks_record_free(hooks, memory);
+    entry->free(device, memory, pAllocator);
+}
+
+static PFN_vkVoidFunction layer_GetDeviceProcAddr(VkDevice device, const char* pName);
+
+/**
+ * Return the device functions the layer wraps
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param name
+ *   Name of the function
+ *
+ * \return
+ *   Wrapper, or NULL if the function isn't wrapped
+ */
+static PFN_vkVoidFunction device_hook(const char* name) {
+    static const hook_symbol hooks[] = {
+        HOOK_SYMBOL("vkGetDeviceProcAddr", layer_GetDeviceProcAddr, NULL),
+        HOOK_SYMBOL("vkDestroyDevice", layer_DestroyDevice, NULL),
+        HOOK_SYMBOL("vkAllocateMemory", layer_AllocateMemory, NULL),
+        HOOK_SYMBOL("vkFreeMemory", layer_FreeMemory, NULL),
+        HOOK_SYMBOL("vkCreateImage", layer_CreateImage, NULL),
+        HOOK_SYMBOL("vkBindImageMemory", layer_BindImageMemory, NULL),
+        HOOK_SYMBOL("vkBindImageMemory2", layer_BindImageMemory2, NULL),
+        HOOK_SYMBOL("vkBindImageMemory2KHR", layer_BindImageMemory2, NULL)
+    };
+    const hook_symbol* symbol = hooks_find(hooks, HOOK_COUNT(hooks), name);
+    return symbol ? (PFN_vkVoidFunction) symbol->hook : NULL;
+}
+
+static PFN_vkVoidFunction layer_GetDeviceProcAddr(VkDevice device, const char* pName) {
+    layer_device* entry = device ? find_device(dispatch_key(device)) : NULL;
+    PFN_vkVoidFunction next = entry ? entry->next_proc_addr(device, pName) : NULL;
+
+    // (wrappers are only handed out for functions the device has, vkBindImageMemory2KHR needs its extension)
+    PFN_vkVoidFunction hook = device_hook(pName);
+    return hook && (next || !entry) ? hook : next;
+}
+
+static PFN_vkVoidFunction layer_GetInstanceProcAddr(VkInstance instance, const char* pName) {
+    static const hook_symbol hooks[] = {
+        HOOK_SYMBOL("vkGetInstanceProcAddr", layer_GetInstanceProcAddr, NULL),
+        HOOK_SYMBOL("vkCreateInstance", layer_CreateInstance, NULL),
+        HOOK_SYMBOL("vkDestroyInstance", layer_DestroyInstance, NULL),
+        HOOK_SYMBOL("vkCreateDevice", layer_CreateDevice, NULL)
+    };
+    const hook_symbol* symbol = hooks_find(hooks, HOOK_COUNT(hooks), pName);
+    if (symbol)
+        return (PFN_vkVoidFunction) symbol->hook;
+    PFN_vkVoidFunction hook = device_hook(pName);
+    if (hook)
+        return hook;
+
+    layer_instance* entry = instance ? find_instance(dispatch_key(instance)) : NULL;
+    return entry ? entry->next_proc_addr(instance, pName) : NULL;
+}
+
+/**
+ * Hand the layer's entry points to the Vulkan loader
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param pVersionStruct
+ *   Interface version offered by the loader, and the layer's entry points
+ *
+ * \return
+ *   VK_SUCCESS if the loader supports the layer interface, an error otherwise
+ */
+VK_LAYER_EXPORT VkResult VKAPI_CALL vkNegotiateLoaderLayerInterfaceVersion(VkNegotiateLayerInterface* pVersionStruct) {
+    if (pVersionStruct->sType != LAYER_NEGOTIATE_INTERFACE_STRUCT || pVersionStruct->loaderLayerInterfaceVersion < 2)
+        return VK_ERROR_INITIALIZATION_FAILED;
+
+    pVersionStruct->loaderLayerInterfaceVersion = 2;
+    pVersionStruct->pfnGetInstanceProcAddr = layer_GetInstanceProcAddr;
+    pVersionStruct->pfnGetDeviceProcAddr = layer_GetDeviceProcAddr;
+    pVersionStruct->pfnGetPhysicalDeviceProcAddr = NULL;
+    return VK_SUCCESS;
+}
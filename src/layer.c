@@ -0,0 +1,317 @@
+#define _GNU_SOURCE
+#include "layer.h"
+
+#include <obs/obs-module.h>
+#include <vulkan/vulkan.h>
+#include <dlfcn.h>
+#include <link.h>
+#include <elf.h>
+#include <sys/mman.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define GLX_NAME "libGLX.so.0"
+#define GLX_SENTINEL_HANDLE ((void*) 1)
+#define NVFBC_NAME "libnvidia-fbc"
+
+// relocations binding NvFBC's imports (only the architectures NvFBC ships for)
+#if defined(__x86_64__)
+#define RELOC_JUMP_SLOT R_X86_64_JUMP_SLOT
+#define RELOC_GLOB_DAT R_X86_64_GLOB_DAT
+#elif defined(__aarch64__)
+#define RELOC_JUMP_SLOT R_AARCH64_JUMP_SLOT
+#define RELOC_GLOB_DAT R_AARCH64_GLOB_DAT
+#endif
+
+_Atomic(NvFBCCustomState*) nvfbc_layer_state; //!< State the Vulkan layer records into, looked up by the layer as HOOKS_LAYER_STATE_SYMBOL (NULL until it is published)
+
+static void* glx_handle; //!< Real libGLX.so.0 opened for NvFBC
+static PFN_vkGetInstanceProcAddr get_instance_proc_addr_real; //!< Real vkGetInstanceProcAddr looked up by NvFBC
+static PFN_vkCreateInstance create_instance_real; //!< Real vkCreateInstance looked up by NvFBC
+
+/**
+ * Create NvFBC's Vulkan instance with the layer enabled
+ *
+ * The layer is explicit, so no other instance in the process loads it.
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param pCreateInfo
+ *   NvFBC's create info
+ * \param pAllocator
+ *   Allocation callbacks
+ * \param pInstance
+ *   Created instance
+ *
+ * \return
+ *   Result of the real vkCreateInstance
+ */
+static VkResult nvfbc_vkCreateInstance(const VkInstanceCreateInfo* pCreateInfo, const VkAllocationCallbacks* pAllocator, VkInstance* pInstance) {
+    uint32_t count = pCreateInfo->enabledLayerCount;
+    for (uint32_t i = 0; i < count; i++) {
+        if (!strcmp(pCreateInfo->ppEnabledLayerNames[i], HOOKS_LAYER_NAME))
+            return create_instance_real(pCreateInfo, pAllocator, pInstance);
+    }
+
+    const char** layers = calloc(count + 1, sizeof(const char*));
+    if (!layers)
+        return VK_ERROR_OUT_OF_HOST_MEMORY;
+    if (count)
+        memcpy(layers, pCreateInfo->ppEnabledLayerNames, count * sizeof(const char*));
+    layers[count] = HOOKS_LAYER_NAME;
+
+    VkInstanceCreateInfo info = *pCreateInfo;
+    info.enabledLayerCount = count + 1;
+    info.ppEnabledLayerNames = layers;
+    VkResult res = create_instance_real(&info, pAllocator, pInstance);
+    free(layers);
+    return res;
+}
+
+/**
+ * Look up a Vulkan function for NvFBC, enabling the layer on its instance
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param instance
+ *   Instance to look the function up for
+ * \param name
+ *   Name of the function
+ *
+ * \return
+ *   Function
+ */
+static PFN_vkVoidFunction nvfbc_vkGetInstanceProcAddr(VkInstance instance, const char* name) {
+    PFN_vkVoidFunction function = get_instance_proc_addr_real(instance, name);
+    if (!instance && function && !strcmp(name, "vkCreateInstance")) {
+        create_instance_real = (PFN_vkCreateInstance) function;
+        return (PFN_vkVoidFunction) nvfbc_vkCreateInstance;
+    }
+    return function;
+}
+
+/**
+ * Open a library for NvFBC, handing out a sentinel for libGLX.so.0
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param file
+ *   The file to open
+ * \param mode
+ *   The mode to open the file in
+ *
+ * \return
+ *   Library handle
+ */
+static void* nvfbc_dlopen(const char* file, int mode) {
+    if (!file || strcmp(file, GLX_NAME))
+        return dlopen(file, mode);
+
+    glx_handle = dlopen(file, mode);
+    return GLX_SENTINEL_HANDLE;
+}
+
+/**
+ * Look up a symbol for NvFBC, returning stubs for its GLX calls and wrapping its Vulkan instance creation
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param handle
+ *   The handle to search in
+ * \param name
+ *   The name of the symbol
+ *
+ * \return
+ *   Symbol, or NULL if it wasn't found
+ */
+static void* nvfbc_dlsym(void* handle, const char* name) {
+    if (handle != GLX_SENTINEL_HANDLE) {
+        void* symbol = dlsym(handle, name);
+        if (symbol && !strcmp(name, "vkGetInstanceProcAddr")) {
+            get_instance_proc_addr_real = (PFN_vkGetInstanceProcAddr) symbol;
+            return (void*) nvfbc_vkGetInstanceProcAddr;
+        }
+        if (symbol && !strcmp(name, "vkCreateInstance")) {
+            create_instance_real = (PFN_vkCreateInstance) symbol;
+            return (void*) nvfbc_vkCreateInstance;
+        }
+        return symbol;
+    }
+
+    void* stub = hooks_glx_symbol(name);
+    return stub ? stub : dlsym(glx_handle, name);
+}
+
+/**
+ * Close a library opened by NvFBC
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param handle
+ *   The handle to close
+ *
+ * \return
+ *   0 on success, non-zero otherwise
+ */
+static int nvfbc_dlclose(void* handle) {
+    return dlclose(handle == GLX_SENTINEL_HANDLE ? glx_handle : handle);
+}
+
+static const hook_symbol imports[] = {
+    HOOK_SYMBOL("dlopen", nvfbc_dlopen, NULL),
+    HOOK_SYMBOL("dlsym", nvfbc_dlsym, NULL),
+    HOOK_SYMBOL("dlclose", nvfbc_dlclose, NULL)
+}; //!< NvFBC's imports redirected into the plugin
+
+#ifdef RELOC_JUMP_SLOT
+/**
+ * Resolve an address from the dynamic section of a loaded object
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param info
+ *   Loaded object
+ * \param entry
+ *   Dynamic section entry
+ *
+ * \return
+ *   Address (glibc already relocates most entries in place, others are relative to the object)
+ */
+static uintptr_t dynamic_address(struct dl_phdr_info* info, const ElfW(Dyn)* entry) {
+    return entry->d_un.d_ptr < info->dlpi_addr ? info->dlpi_addr + entry->d_un.d_ptr : entry->d_un.d_ptr;
+}
+
+/**
+ * Point libnvidia-fbc's GOT entries of dlopen, dlsym and dlclose at the plugin
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param info
+ *   Loaded object
+ * \param data
+ *   Bit mask of the redirected imports
+ *
+ * \return
+ *   1 once libnvidia-fbc was patched (stopping the iteration), 0 otherwise
+ */
+static int redirect_imports(struct dl_phdr_info* info, size_t, void* data) {
+    if (!info->dlpi_name || !strstr(info->dlpi_name, NVFBC_NAME))
+        return 0;
+
+    const ElfW(Dyn)* dynamic = NULL;
+    uintptr_t relro_start = 0, relro_end = 0;
+    for (int i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr)* phdr = &info->dlpi_phdr[i];
+        if (phdr->p_type == PT_DYNAMIC)
+            dynamic = (const ElfW(Dyn)*) (info->dlpi_addr + phdr->p_vaddr);
+        if (phdr->p_type == PT_GNU_RELRO) {
+            relro_start = info->dlpi_addr + phdr->p_vaddr;
+            relro_end = relro_start + phdr->p_memsz;
+        }
+    }
+    if (!dynamic)
+        return 1;
+
+    // imports are bound through the PLT (DT_JMPREL) or, without lazy binding, through the GOT (DT_RELA)
+    const ElfW(Sym)* symbols = NULL;
+    const char* strings = NULL;
+    const ElfW(Rela)* tables[2] = { NULL };
+    size_t sizes[2] = { 0 };
+    for (const ElfW(Dyn)* entry = dynamic; entry->d_tag != DT_NULL; entry++) {
+        switch (entry->d_tag) {
+            case DT_SYMTAB: symbols = (const ElfW(Sym)*) dynamic_address(info, entry); break;
+            case DT_STRTAB: strings = (const char*) dynamic_address(info, entry); break;
+            case DT_JMPREL: tables[0] = (const ElfW(Rela)*) dynamic_address(info, entry); break;
+            case DT_PLTRELSZ: sizes[0] = entry->d_un.d_val; break;
+            case DT_RELA: tables[1] = (const ElfW(Rela)*) dynamic_address(info, entry); break;
+            case DT_RELASZ: sizes[1] = entry->d_un.d_val; break;
+        }
+    }
+    if (!symbols || !strings)
+        return 1;
+
+    uintptr_t page_size = sysconf(_SC_PAGESIZE);
+    for (int t = 0; t < 2; t++) {
+        for (size_t i = 0; tables[t] && i < sizes[t] / sizeof(ElfW(Rela)); i++) {
+            const ElfW(Rela)* rela = &tables[t][i];
+            uint32_t type = ELF64_R_TYPE(rela->r_info);
+            if (type != RELOC_JUMP_SLOT && type != RELOC_GLOB_DAT)
+                continue;
+
+            const hook_symbol* import = hooks_find(imports, HOOK_COUNT(imports), strings + symbols[ELF64_R_SYM(rela->r_info)].st_name);
+            if (!import)
+                continue;
+
+            // entries in the RELRO segment were made read-only after relocation
+            void** slot = (void**) (info->dlpi_addr + rela->r_offset);
+            void* page = (void*) ((uintptr_t) slot & ~(page_size - 1));
+            bool relro = (uintptr_t) slot >= relro_start && (uintptr_t) slot < relro_end;
+            if (relro && mprotect(page, page_size, PROT_READ | PROT_WRITE)) {
+                blog(LOG_ERROR, "Failed to make NvFBC's import of %s writable", import->name);
+                continue;
+            }
+            *slot = import->hook;
+            if (relro)
+                mprotect(page, page_size, PROT_READ);
+            *(unsigned*) data |= 1u << (import - imports);
+        }
+    }
+    return 1;
+}
+#endif
+
+/**
+ * Check whether the Vulkan loader finds the layer
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \return
+ *   True if the layer is installed, false otherwise
+ */
+static bool layer_installed() {
+    uint32_t count = 0;
+    if (vkEnumerateInstanceLayerProperties(&count, NULL) != VK_SUCCESS || !count)
+        return false;
+
+    VkLayerProperties* layers = calloc(count, sizeof(VkLayerProperties));
+    bool found = false;
+    if (vkEnumerateInstanceLayerProperties(&count, layers) == VK_SUCCESS) {
+        for (uint32_t i = 0; i < count && !found; i++)
+            found = !strcmp(layers[i].layerName, HOOKS_LAYER_NAME);
+    }
+    free(layers);
+    return found;
+}
+
+bool layer_start(NvFBCCustomState* state) {
+#ifndef RELOC_JUMP_SLOT
+    blog(LOG_WARNING, "The Vulkan layer isn't supported on this architecture");
+    return false;
+#else
+    if (!layer_installed())
+        return false;
+
+    // the layer can't keep NvFBC away from GLX, so only NvFBC's own dl* calls are redirected (which also enables the layer on NvFBC's instance)
+    unsigned redirected = 0;
+    dl_iterate_phdr(redirect_imports, &redirected);
+    if (!(redirected & 1) || !(redirected & 2)) {
+        blog(LOG_ERROR, "Failed to redirect NvFBC's GLX calls, the Vulkan layer can't be used");
+        return false;
+    }
+
+    // (the layer looks the state up in the plugin, nothing leaves the process)
+    atomic_store_explicit(&nvfbc_layer_state, state, memory_order_release);
+
+    blog(LOG_INFO, "Recording NvFBC's capture buffers with the Vulkan layer %s", HOOKS_LAYER_NAME);
+    return true;
+#endif
+}
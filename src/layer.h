@@ -0,0 +1,25 @@
+#pragma once
+
+#include "hooks/hooks.h"
+
+#include <stdbool.h>
+
+/**
+ * Use the Vulkan layer instead of the preload hooks
+ *
+ * This publishes the state for the layer to record NvFBC's capture buffers
+ * into and stubs NvFBC's GLX calls by redirecting only NvFBC's own imports
+ * of dlopen, dlsym and dlclose. The redirected dlsym also enables the
+ * (explicit) layer on NvFBC's Vulkan instance, and on no other one.
+ * Call it before NvFBC loads libGLX and libvulkan.
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param state
+ *   State the layer records into
+ *
+ * \return
+ *   True if the layer is installed and NvFBC's imports were redirected, false otherwise (or on architectures other than x86_64 and aarch64)
+ */
+bool layer_start(NvFBCCustomState* state);
@@ -0,0 +1,204 @@
+#include "randr.h"
+
+#include <obs/obs-module.h>
+#include <obs/util/threading.h>
+#include <xcb/xcb.h>
+#include <xcb/randr.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <poll.h>
+
+#define RANDR_POLL_MS 100 //!< Interval in which the listener checks whether it should stop
+
+static xcb_connection_t* conn = NULL; //!< Connection of the listener
+static xcb_window_t root; //!< Root window of the default screen
+static uint8_t event_base; //!< First event number of the RandR extension
+
+static pthread_t listener; //!< Listener thread
+static atomic_bool listening = false; //!< Whether the listener should keep running
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER; //!< Lock protecting the cache
+static randr_monitor monitors[RANDR_MAX_MONITORS]; //!< Cached monitors
+static int monitor_count = 0; //!< Number of cached monitors
+static int screen_width, screen_height; //!< Size of the X screen
+static atomic_uint_fast64_t generation = 0; //!< Number of times the cache changed
+
+/**
+ * Query the monitor layout and update the cache if it changed
+ *
+ * All atom names are requested before the first reply is read, so the
+ * refresh costs two round trips no matter how many monitors there are.
+ *
+ * \author
+ *   PancakeTAS
+ */
+static void refresh() {
+    xcb_randr_get_monitors_cookie_t monitors_cookie = xcb_randr_get_monitors(conn, root, 1);
+    xcb_get_geometry_cookie_t geometry_cookie = xcb_get_geometry(conn, root);
+    xcb_randr_get_monitors_reply_t* reply = xcb_randr_get_monitors_reply(conn, monitors_cookie, NULL);
+    xcb_get_geometry_reply_t* geometry = xcb_get_geometry_reply(conn, geometry_cookie, NULL);
+    if (!reply || !geometry) {
+        blog(LOG_WARNING, "Failed to query RandR monitors");
+        free(reply);
+        free(geometry);
+        return;
+    }
+
+    randr_monitor found[RANDR_MAX_MONITORS] = { 0 };
+    xcb_get_atom_name_cookie_t names[RANDR_MAX_MONITORS];
+    int count = 0;
+    xcb_randr_monitor_info_iterator_t iter = xcb_randr_get_monitors_monitors_iterator(reply);
+    for (; iter.rem && count < RANDR_MAX_MONITORS; xcb_randr_monitor_info_next(&iter), count++) {
+        xcb_randr_monitor_info_t* monitor = iter.data;
+        found[count].x = monitor->x;
+        found[count].y = monitor->y;
+        found[count].width = monitor->width;
+        found[count].height = monitor->height;
+        found[count].primary = monitor->primary;
+        if (xcb_randr_monitor_info_outputs_length(monitor))
+            found[count].output_id = xcb_randr_monitor_info_outputs(monitor)[0];
+        names[count] = xcb_get_atom_name(conn, monitor->name);
+    }
+    for (int i = 0; i < count; i++) {
+        xcb_get_atom_name_reply_t* name = xcb_get_atom_name_reply(conn, names[i], NULL);
+        if (name)
+            snprintf(found[i].name, sizeof(found[i].name), "%.*s", xcb_get_atom_name_name_length(name), xcb_get_atom_name_name(name));
+        free(name);
+    }
+
+    // only count actual changes, RandR reports a lot of events that don't change the layout
+    pthread_mutex_lock(&cache_lock);
+    bool changed = count != monitor_count || memcmp(found, monitors, sizeof(found))
+        || geometry->width != screen_width || geometry->height != screen_height;
+    if (changed) {
+        memcpy(monitors, found, sizeof(found));
+        monitor_count = count;
+        screen_width = geometry->width;
+        screen_height = geometry->height;
+        atomic_fetch_add(&generation, 1);
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    if (changed)
+        blog(LOG_INFO, "Monitor layout changed: %d monitors on a %dx%d screen", count, geometry->width, geometry->height);
+    free(reply);
+    free(geometry);
+}
+
+/**
+ * Refresh the cache whenever RandR reports a change
+ *
+ * \author
+ *   PancakeTAS
+ */
+static void* listener_thread(void*) {
+    os_set_thread_name("nvfbc-randr");
+
+    struct pollfd fd = { .fd = xcb_get_file_descriptor(conn), .events = POLLIN };
+    while (atomic_load(&listening)) {
+        if (poll(&fd, 1, RANDR_POLL_MS) <= 0)
+            continue;
+
+        // coalesce a burst of events into a single refresh
+        bool dirty = false;
+        xcb_generic_event_t* event;
+        while ((event = xcb_poll_for_event(conn))) {
+            uint8_t type = event->response_type & ~0x80;
+            dirty |= type == event_base + XCB_RANDR_SCREEN_CHANGE_NOTIFY || type == event_base + XCB_RANDR_NOTIFY;
+            free(event);
+        }
+        if (xcb_connection_has_error(conn)) {
+            blog(LOG_ERROR, "Lost the X connection, monitor changes aren't tracked anymore");
+            break;
+        }
+        if (dirty)
+            refresh();
+    }
+
+    return NULL;
+}
+
+bool randr_start() {
+    conn = xcb_connect(NULL, NULL);
+    if (xcb_connection_has_error(conn)) {
+        blog(LOG_ERROR, "Failed to connect to the X server");
+        xcb_disconnect(conn);
+        conn = NULL;
+        return false;
+    }
+    root = xcb_setup_roots_iterator(xcb_get_setup(conn)).data->root;
+
+    const xcb_query_extension_reply_t* extension = xcb_get_extension_data(conn, &xcb_randr_id);
+    if (!extension || !extension->present) {
+        blog(LOG_ERROR, "X server doesn't support RandR");
+        xcb_disconnect(conn);
+        conn = NULL;
+        return false;
+    }
+    event_base = extension->first_event;
+
+    // subscribe before the first refresh, so no change slips through in between
+    xcb_randr_select_input(conn, root, XCB_RANDR_NOTIFY_MASK_SCREEN_CHANGE | XCB_RANDR_NOTIFY_MASK_CRTC_CHANGE
+        | XCB_RANDR_NOTIFY_MASK_OUTPUT_CHANGE | XCB_RANDR_NOTIFY_MASK_OUTPUT_PROPERTY);
+    xcb_flush(conn);
+    refresh();
+
+    atomic_store(&listening, true);
+    if (pthread_create(&listener, NULL, listener_thread, NULL)) {
+        blog(LOG_ERROR, "Failed to create RandR listener thread, monitor changes aren't tracked");
+        atomic_store(&listening, false);
+    }
+    return true;
+}
+
+void randr_stop() {
+    if (atomic_load(&listening)) {
+        atomic_store(&listening, false);
+        pthread_join(listener, NULL);
+    }
+    if (conn) {
+        xcb_disconnect(conn);
+        conn = NULL;
+    }
+}
+
+uint64_t randr_generation() {
+    return atomic_load_explicit(&generation, memory_order_acquire);
+}
+
+int randr_get_monitors(randr_monitor* out) {
+    pthread_mutex_lock(&cache_lock);
+    memcpy(out, monitors, sizeof(monitors));
+    int count = monitor_count;
+    pthread_mutex_unlock(&cache_lock);
+    return count;
+}
+
+bool randr_tracked_area(const char* tracking_type, randr_monitor* area) {
+    // outputs are stored as "<name>: <mode>", only the name stays the same across mode changes
+    size_t name_length = strcspn(tracking_type, ":");
+    bool found = false;
+
+    pthread_mutex_lock(&cache_lock);
+    for (int i = 0; i < monitor_count && tracking_type[0] != '2' && !found; i++) {
+        if (tracking_type[0] == '0' ? monitors[i].primary
+                : strlen(monitors[i].name) == name_length && !strncmp(monitors[i].name, tracking_type, name_length)) {
+            *area = monitors[i];
+            found = true;
+        }
+    }
+
+    // NvFBC's default falls back to the first connected output, then to the whole X screen
+    if (!found && tracking_type[0] == '0' && monitor_count) {
+        *area = monitors[0];
+        found = true;
+    }
+    if (!found && (tracking_type[0] == '2' || tracking_type[0] == '0')) {
+        *area = (randr_monitor) { .name = "Screen", .width = screen_width, .height = screen_height };
+        found = screen_width && screen_height;
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    return found;
+}
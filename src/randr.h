@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define RANDR_MAX_MONITORS 16 //!< Maximum number of monitors kept in the cache
+
+typedef struct {
+    char name[128]; //!< Name of the monitor (the name of its output for automatic monitors)
+    int x, y, width, height; //!< Geometry within the X screen
+    bool primary; //!< Whether this is the primary monitor
+    uint32_t output_id; //!< RandR id of the first output, which NvFBC uses as output id
+} randr_monitor; //!< Cached RandR monitor
+
+/**
+ * Fill the monitor cache and start listening for RandR changes
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \return
+ *   True if the listener is running, false otherwise
+ */
+bool randr_start();
+
+/**
+ * Stop listening for RandR changes
+ *
+ * \author
+ *   PancakeTAS
+ */
+void randr_stop();
+
+/**
+ * Return the number of times the monitor layout changed
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \return
+ *   Generation of the monitor cache
+ */
+uint64_t randr_generation();
+
+/**
+ * Copy the cached monitors
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param monitors
+ *   Monitors to fill (RANDR_MAX_MONITORS entries)
+ *
+ * \return
+ *   Number of monitors
+ */
+int randr_get_monitors(randr_monitor* monitors);
+
+/**
+ * Find the area NvFBC tracks for a tracking type setting
+ *
+ * The default is resolved like NvFBC does: the primary monitor, otherwise
+ * the first connected one, otherwise the whole X screen.
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param tracking_type
+ *   Tracking type setting ("0" for NvFBC's default, "2" for the X screen, otherwise "<output>: <mode>")
+ * \param area
+ *   Tracked area
+ *
+ * \return
+ *   True if the area was found, false otherwise
+ */
+bool randr_tracked_area(const char* tracking_type, randr_monitor* area);
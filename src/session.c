@@ -0,0 +1,149 @@
+#include "session.h"
+
+#include <obs/obs-module.h>
+
+NVFBC_API_FUNCTION_LIST fbc = { .dwVersion = NVFBC_VERSION }; //!< NvFBC API function list
+
+bool session_create(fbc_session* session, capture_params* params, NVFBC_CAPTURE_TYPE type) {
+    // create NvFBC session to grab status
+    NVFBCSTATUS status = fbc.nvFBCCreateHandle(&session->handle, &(NVFBC_CREATE_HANDLE_PARAMS) { .dwVersion = NVFBC_CREATE_HANDLE_PARAMS_VER });
+    if (status) {
+        blog(LOG_ERROR, "Failed to create NvFBC session: %d", status);
+        return false;
+    }
+
+    // creating the handle binds the context to this thread
+    session->bound = true;
+    session->owner = pthread_self();
+    session->timings = params->timings;
+
+    // get NvFBC status
+    NVFBC_GET_STATUS_PARAMS status_params = { .dwVersion = NVFBC_GET_STATUS_PARAMS_VER };
+    status = fbc.nvFBCGetStatus(session->handle, &status_params);
+    if (status) {
+        blog(LOG_ERROR, "Failed to get NvFBC status: %d", status);
+        return false;
+    }
+
+    // find output id
+    int dwOutputId = -1;
+    if (params->tracking_type == 1) {
+        for (uint32_t i = 0; i < status_params.dwOutputNum; i++) {
+            if (!strncmp(status_params.outputs[i].name, params->display_name, 127)) {
+                dwOutputId = status_params.outputs[i].dwId;
+                break;
+            }
+        }
+    }
+
+    // create NvFBC capture session
+    status = fbc.nvFBCCreateCaptureSession(session->handle, &(NVFBC_CREATE_CAPTURE_SESSION_PARAMS) {
+        .dwVersion = NVFBC_CREATE_CAPTURE_SESSION_PARAMS_VER,
+        .eCaptureType = type,
+        .bWithCursor = params->with_cursor,
+        .eTrackingType = params->tracking_type,
+        .frameSize = {
+            .w = params->frame_width,
+            .h = params->frame_height
+        },
+        .captureBox = {
+            .x = params->has_capture_area ? params->capture_x : 0,
+            .y = params->has_capture_area ? params->capture_y : 0,
+            .w = params->has_capture_area ? params->capture_width : 0,
+            .h = params->has_capture_area ? params->capture_height : 0
+        },
+        .dwOutputId = dwOutputId,
+        .dwSamplingRateMs = params->sampling_rate,
+        .bPushModel = params->push_model,
+        .bAllowDirectCapture = params->direct_mode
+    });
+    if (status) {
+        blog(LOG_ERROR, "Failed to create NvFBC capture session: %d", status);
+        return false;
+    }
+
+    return true;
+}
+
+bool session_bind(fbc_session* session) {
+    if (session->bound && pthread_equal(session->owner, pthread_self()))
+        return true;
+
+    uint64_t start = timing_begin(STAGE_BIND);
+    NVFBCSTATUS status = fbc.nvFBCBindContext(session->handle, &(NVFBC_BIND_CONTEXT_PARAMS) { .dwVersion = NVFBC_BIND_CONTEXT_PARAMS_VER });
+    timing_end(session->timings, STAGE_BIND, start);
+    if (status) {
+        blog(LOG_ERROR, "Failed to bind NvFBC context: %d", status);
+        return false;
+    }
+
+    session->bound = true;
+    session->owner = pthread_self();
+    return true;
+}
+
+void session_release(fbc_session* session) {
+    if (!session->bound || !pthread_equal(session->owner, pthread_self()))
+        return;
+
+    uint64_t start = timing_begin(STAGE_RELEASE);
+    NVFBCSTATUS status = fbc.nvFBCReleaseContext(session->handle, &(NVFBC_RELEASE_CONTEXT_PARAMS) { .dwVersion = NVFBC_RELEASE_CONTEXT_PARAMS_VER });
+    timing_end(session->timings, STAGE_RELEASE, start);
+    if (status) {
+        blog(LOG_ERROR, "Failed to release NvFBC context: %d", status);
+        return;
+    }
+
+    session->bound = false;
+}
+
+void session_destroy(fbc_session* session) {
+    // bind context
+    if (!session_bind(session))
+        return;
+
+    // destroy NvFBC capture session
+    NVFBCSTATUS status = fbc.nvFBCDestroyCaptureSession(session->handle, &(NVFBC_DESTROY_CAPTURE_SESSION_PARAMS) { .dwVersion = NVFBC_DESTROY_CAPTURE_SESSION_PARAMS_VER });
+    if (status)
+        blog(LOG_ERROR, "Failed to destroy NvFBC capture session: %d", status);
+
+    // destroy NvFBC session
+    status = fbc.nvFBCDestroyHandle(session->handle, &(NVFBC_DESTROY_HANDLE_PARAMS) { .dwVersion = NVFBC_DESTROY_HANDLE_PARAMS_VER });
+    if (status)
+        blog(LOG_ERROR, "Failed to destroy NvFBC session: %d", status);
+
+    session->bound = false;
+}
+
+bool session_lost(NVFBCSTATUS status) {
+    return status == NVFBC_ERR_MUST_RECREATE || status == NVFBC_ERR_X;
+}
+
+float session_changed_area(const uint8_t* diffmap, int width, int height) {
+    if (!diffmap || width <= 0 || height <= 0)
+        return 1.0f;
+
+    size_t size = (size_t) width * height;
+    size_t changed = 0;
+    for (size_t i = 0; i < size; i++)
+        changed += diffmap[i] != 0;
+
+    return changed / (float) size;
+}
+
+void session_grab_flags(grab_mode mode, uint32_t* flags, uint32_t* timeout) {
+    switch (mode) {
+        case GRAB_MODE_NOWAIT_IF_NEW_FRAME_READY:
+            *flags = NVFBC_TOGL_GRAB_FLAGS_NOWAIT_IF_NEW_FRAME_READY;
+            *timeout = GRAB_TIMEOUT_MS;
+            break;
+        case GRAB_MODE_BLOCKING:
+            *flags = NVFBC_TOGL_GRAB_FLAGS_NOFLAGS;
+            *timeout = GRAB_TIMEOUT_MS;
+            break;
+        default:
+            *flags = NVFBC_TOGL_GRAB_FLAGS_NOWAIT;
+            *timeout = 0;
+            break;
+    }
+}
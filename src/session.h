@@ -0,0 +1,124 @@
+#pragma once
+
+#include "source.h"
+
+#include <pthread.h>
+#include <NvFBC.h>
+
+#define GRAB_TIMEOUT_MS 100 //!< Timeout for waiting grabs, so the capture thread can notice it should stop
+
+typedef struct {
+    NVFBC_SESSION_HANDLE handle; //!< NvFBC session handle
+    bool bound; //!< Whether the NvFBC context is bound to a thread
+    pthread_t owner; //!< Thread the NvFBC context is bound to
+    stage_timings* timings; //!< Timings to record binds and releases into (may be NULL)
+} fbc_session; //!< NvFBC session owned by a single thread at a time
+
+extern NVFBC_API_FUNCTION_LIST fbc; //!< NvFBC API function list
+
+/**
+ * Create an NvFBC handle and capture session
+ *
+ * The NvFBC context is bound to the calling thread afterwards.
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param session
+ *   Session to create
+ * \param params
+ *   Capture parameters
+ * \param type
+ *   Capture type
+ *
+ * \return
+ *   True if the session was created, false otherwise
+ */
+bool session_create(fbc_session* session, capture_params* params, NVFBC_CAPTURE_TYPE type);
+
+/**
+ * Make the calling thread the owner of the NvFBC context
+ *
+ * This does nothing if the calling thread already owns it, so it can be called before every grab.
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param session
+ *   Session to bind
+ *
+ * \return
+ *   True if the context is bound to the calling thread, false otherwise
+ */
+bool session_bind(fbc_session* session);
+
+/**
+ * Give up ownership of the NvFBC context, if the calling thread owns it
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param session
+ *   Session to release
+ */
+void session_release(fbc_session* session);
+
+/**
+ * Destroy the capture session and NvFBC handle
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param session
+ *   Session to destroy
+ */
+void session_destroy(fbc_session* session);
+
+/**
+ * Check whether a status means the capture session is gone
+ *
+ * NvFBC can't grab again after these errors until the session is recreated.
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param status
+ *   Status returned by NvFBC
+ *
+ * \return
+ *   True if the session has to be recreated, false otherwise
+ */
+bool session_lost(NVFBCSTATUS status);
+
+/**
+ * Calculate the fraction of blocks a differential map marks as changed
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param diffmap
+ *   Differential map
+ * \param width
+ *   Width of the differential map
+ * \param height
+ *   Height of the differential map
+ *
+ * \return
+ *   Changed fraction between 0 and 1
+ */
+float session_changed_area(const uint8_t* diffmap, int width, int height);
+
+/**
+ * Translate a grab mode into NvFBC grab flags (identical for all capture types)
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param mode
+ *   Grab mode
+ * \param flags
+ *   Output grab flags
+ * \param timeout
+ *   Output grab timeout in ms
+ */
+void session_grab_flags(grab_mode mode, uint32_t* flags, uint32_t* timeout);
@@ -1,22 +1,36 @@
 
 #include "source.h"
+#include "capture.h"
+#include "randr.h"
 
 #include <obs/obs-module.h>
-#include <xcb/xcb.h>
-#include <xcb/randr.h>
+#include <obs/util/platform.h>
+#include <obs/util/threading.h>
 
 typedef struct {
-    obs_source_t* source; //!< OBS source
-    gs_texture_t* textures[2]; //!< Texture to render to
+    bool enabled; //!< Whether the source cuts its area out of a shared capture of the whole tracked area
+    int x, y, width, height; //!< Area within the capture
+    uint32_t frame_width, frame_height; //!< Size the area is scaled to
+} source_crop; //!< Capture area sampled from a shared capture
 
-    bool is_capturing; //!< Whether the source is capturing
-    capture_params params; //!< Capture parameters
+typedef struct {
+    obs_source_t* source; //!< OBS source
+    bool async; //!< Whether frames are captured to system memory and handed to OBS as async video
+    uint32_t width; //!< Width of the running capture
+    uint32_t height; //!< Height of the running capture
+
+    pthread_mutex_t lock; //!< Lock protecting capture and next
+    fbc_capture* capture; //!< Running capture (NULL until the first one is ready)
+    fbc_capture* next; //!< Texture capture waiting to be swapped in
+    source_crop crop; //!< Area cut out of the running capture
+    source_crop next_crop; //!< Area to cut out of the next capture
+    randr_monitor tracked; //!< Area tracked by the latest settings (guarded by lock)
+    bool has_tracked; //!< Whether the tracked area was found (guarded by lock)
+    uint64_t randr_generation; //!< Monitor layout the tracked area was last checked against (video_tick() only)
+    bool opaque_buffers; //!< Whether sharing the capture buffers as DMA-BUFs failed, every later capture keeps the backend's own buffers (guarded by lock)
+    stage_timings timings; //!< Timings of the stages the source runs itself (render), the other stages are timed by the shared capture
 } fbc_source; //!< NvFBC source data
 
-static void (*start_callback)(capture_params*); //!< Callback to start capturing
-static void (*capture_callback)(capture_params*); //!< Callback to capture a frame
-static void (*stop_callback)(capture_params*); //!< Callback to stop capturing
-
 /**
  * Return name of the source
  *
@@ -30,6 +44,19 @@ static const char* get_name(void* unused) {
     return "NvFBC Source";
 }
 
+/**
+ * Return name of the system memory source
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \return
+ *   Name of the source
+ */
+static const char* get_sys_name(void* unused) {
+    return "NvFBC Source (System Memory)";
+}
+
 /**
  * Return width of the source
  *
@@ -40,7 +67,7 @@ static const char* get_name(void* unused) {
  *   Source data
  */
 static uint32_t get_width(void* data) {
-    return ((fbc_source*) data)->params.frame_width;
+    return ((fbc_source*) data)->width;
 }
 
 /**
@@ -53,40 +80,52 @@ static uint32_t get_width(void* data) {
  *   Source data
  */
 static uint32_t get_height(void* data) {
-    return ((fbc_source*) data)->params.frame_height;
+    return ((fbc_source*) data)->height;
 }
 
 /**
- * Reload source on reload click
+ * Make a capture the running one
+ *
+ * Must be called with the lock held (and the graphics context entered for texture sources).
  *
  * \author
  *   PancakeTAS
  *
- * \param data
+ * \param source_data
  *   Source data
+ * \param capture
+ *   Capture
+ * \param crop
+ *   Area to cut out of the capture
+ */
+static void set_capture(fbc_source* source_data, fbc_capture* capture, const source_crop* crop) {
+    source_data->capture = capture;
+    source_data->crop = *crop;
+    source_data->width = crop->enabled ? crop->frame_width : (uint32_t) capture->key.params.frame_width;
+    source_data->height = crop->enabled ? crop->frame_height : (uint32_t) capture->key.params.frame_height;
+}
+
+/**
+ * Read the capture configuration from the source settings
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param source_data
+ *   Source data
+ * \param settings
+ *   Settings of the source
+ * \param config
+ *   Configuration to fill
+ * \param crop
+ *   Capture area to fill
  *
  * \return
- *  True if the source was reloaded successfully, false otherwise
+ *   True if a usable backend was found, false otherwise
  */
-static bool on_reload(obs_properties_t*, obs_property_t *, void *data) {
-    fbc_source* source_data = (fbc_source*) data;
-
-    // stop the source
-    obs_enter_graphics();
-    if (source_data->is_capturing) {
-        source_data->is_capturing = false;
-
-        // close the textures
-        gs_texture_destroy(source_data->textures[0]);
-        gs_texture_destroy(source_data->textures[1]);
-
-        stop_callback(&source_data->params);
-    }
-    obs_leave_graphics();
-
-    // recreate capture params
-    obs_data_t* settings = obs_source_get_settings(source_data->source);
-    capture_params* params = &source_data->params;
+static bool read_config(fbc_source* source_data, obs_data_t* settings, capture_config* config, source_crop* crop) {
+    *config = (capture_config) { .async = source_data->async };
+    capture_params* params = &config->params;
     params->frame_width = obs_data_get_int(settings, "width");
     params->frame_height = obs_data_get_int(settings, "height");
     params->with_cursor = obs_data_get_bool(settings, "with_cursor");
@@ -103,6 +142,36 @@ static bool on_reload(obs_properties_t*, obs_property_t *, void *data) {
         params->tracking_type = tracking_type[0] - '0';
     }
 
+    config->threaded = source_data->async || obs_data_get_bool(settings, "capture_thread");
+    params->mode = config->threaded ? obs_data_get_int(settings, "grab_mode") : GRAB_MODE_NOWAIT;
+    config->use_timestamps = obs_data_get_bool(settings, "use_timestamps");
+    params->with_diffmap = obs_data_get_bool(settings, "with_diffmap");
+    params->diffmap_scale = obs_data_get_int(settings, "diffmap_scale");
+    params->opaque_buffers = source_data->async || !obs_data_get_bool(settings, "dmabuf_modifiers") || source_data->opaque_buffers;
+
+    // pick the backend (texture sources need their textures exported, the others take frames in system memory)
+    config->backend = backend_find(obs_data_get_string(settings, "backend"), source_data->async ? BACKEND_CAP_SYSTEM_MEMORY : BACKEND_CAP_TEXTURE);
+    if (!config->backend) {
+        blog(LOG_ERROR, "No usable capture backend for nvfbc obs source");
+        return false;
+    }
+    uint32_t caps = config->backend->capabilities();
+
+    // the GL texture capture bypasses NvFBC's conversion, so only system memory sources can change the format
+    params->format = source_data->async ? obs_data_get_int(settings, "pixel_format") : PIXEL_FORMAT_BGRA;
+    if (params->format != PIXEL_FORMAT_BGRA && !(caps & BACKEND_CAP_YUV)) {
+        blog(LOG_WARNING, "%s can't deliver YUV frames, falling back to BGRA", config->backend->name);
+        params->format = PIXEL_FORMAT_BGRA;
+    }
+    if (params->with_diffmap && !(caps & BACKEND_CAP_DIFFMAP)) {
+        blog(LOG_WARNING, "%s can't track changed regions, disabling change tracking", config->backend->name);
+        params->with_diffmap = false;
+    }
+    if (params->format != PIXEL_FORMAT_BGRA && params->with_diffmap) {
+        blog(LOG_WARNING, "NvFBC can't track changed regions of YUV frames, disabling change tracking");
+        params->with_diffmap = false;
+    }
+
     params->direct_mode = obs_data_get_bool(settings, "direct_capture");
     if (params->direct_mode) {
         params->with_cursor = false;
@@ -117,42 +186,137 @@ static bool on_reload(obs_properties_t*, obs_property_t *, void *data) {
         params->capture_height = obs_data_get_int(settings, "capture_height");
     }
 
-    // create textures
-    obs_enter_graphics();
-    for (int i = 0; i < 2; i++) {
-        gs_texture_t* texture = gs_texture_create(params->frame_width, params->frame_height, GS_BGRA, 1, NULL, GS_DYNAMIC);
-        if (!texture) {
-            blog(LOG_ERROR, "Failed to create texture for nvfbc obs source");
-            return false;
+    // cut the area out of a capture of the whole tracked area instead, which every crop of it can share
+    *crop = (source_crop) { 0 };
+    randr_monitor tracked;
+    if (params->has_capture_area && !source_data->async && obs_data_get_bool(settings, "crop_shared")) {
+        if (randr_tracked_area(tracking_type, &tracked)) {
+            int tracked_width = tracked.width, tracked_height = tracked.height;
+            crop->x = params->capture_x < tracked_width ? params->capture_x : tracked_width - 1;
+            crop->y = params->capture_y < tracked_height ? params->capture_y : tracked_height - 1;
+            crop->width = crop->x + params->capture_width <= tracked_width ? params->capture_width : tracked_width - crop->x;
+            crop->height = crop->y + params->capture_height <= tracked_height ? params->capture_height : tracked_height - crop->y;
+            // (a frame size of 0 keeps the native size, which NvFBC would crop the tracked area to)
+            crop->frame_width = params->frame_width ? params->frame_width : crop->width;
+            crop->frame_height = params->frame_height ? params->frame_height : crop->height;
+            crop->enabled = crop->width > 0 && crop->height > 0;
         }
+        if (crop->enabled) {
+            params->has_capture_area = false;
+            params->capture_x = params->capture_y = params->capture_width = params->capture_height = 0;
+            params->frame_width = tracked.width;
+            params->frame_height = tracked.height;
+        } else {
+            blog(LOG_WARNING, "Failed to cut the capture area out of the tracked area, cropping with NvFBC instead");
+        }
+    }
 
-        GLuint gl_texture = *(GLuint*) gs_texture_get_obj(texture);
-        glBindTexture(GL_TEXTURE_2D, gl_texture);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_B, GL_RED);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_R, GL_BLUE);
-        glBindTexture(GL_TEXTURE_2D, 0);
+    return true;
+}
 
-        source_data->textures[i] = texture;
-        source_data->params.textures[i] = gl_texture;
+/**
+ * Switch the source to a capture for a configuration
+ *
+ * The running capture keeps going until the new one is ready: texture
+ * captures are swapped in by video_tick(), system memory captures take over
+ * by themselves once their session is built.
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param source_data
+ *   Source data
+ * \param config
+ *   New configuration
+ * \param crop
+ *   Area to cut out of the new capture
+ * \param rebuild
+ *   Whether to build a new session even if another source already captures the same frames
+ */
+static void switch_capture(fbc_source* source_data, const capture_config* config, const source_crop* crop, bool rebuild) {
+    if (!source_data->async)
+        obs_enter_graphics();
+    pthread_mutex_lock(&source_data->lock);
+
+    // drop a capture that was queued for outdated settings
+    if (source_data->next) {
+        capture_release(source_data->next);
+        source_data->next = NULL;
     }
 
-    // start the source
-    start_callback(&source_data->params);
-    source_data->is_capturing = true;
+    if (source_data->async) {
+        set_capture(source_data, capture_acquire(config, source_data->source, source_data->capture, false), crop);
+    } else {
+        source_data->next = capture_acquire(config, NULL, NULL, !rebuild);
+        source_data->next_crop = *crop;
+    }
 
-    obs_leave_graphics();
+    pthread_mutex_unlock(&source_data->lock);
+    if (!source_data->async)
+        obs_leave_graphics();
+}
 
-    // cleanup
-    obs_data_release(settings);
+/**
+ * Look up the area tracked by the settings and remember it
+ *
+ * Must be called with the source lock held.
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param source_data
+ *   Source data
+ * \param settings
+ *   Settings of the source
+ *
+ * \return
+ *   True if the area differs from the one remembered before, false otherwise
+ */
+static bool track_area(fbc_source* source_data, obs_data_t* settings) {
+    randr_monitor area = { 0 };
+    bool found = randr_tracked_area(obs_data_get_string(settings, "tracking_type"), &area);
+
+    const randr_monitor* tracked = &source_data->tracked;
+    bool changed = found != source_data->has_tracked || strcmp(area.name, tracked->name)
+        || area.x != tracked->x || area.y != tracked->y || area.width != tracked->width || area.height != tracked->height
+        || area.output_id != tracked->output_id;
+    source_data->tracked = area;
+    source_data->has_tracked = found;
+    return changed;
+}
 
-    return true;
+/**
+ * Rebuild the session on reload click
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param data
+ *   Source data
+ *
+ * \return
+ *   True if the session is being rebuilt, false otherwise
+ */
+static bool on_reload(obs_properties_t*, obs_property_t *, void *data) {
+    fbc_source* source_data = (fbc_source*) data;
+
+    obs_data_t* settings = obs_source_get_settings(source_data->source);
+    capture_config config;
+    source_crop crop;
+    bool usable = read_config(source_data, settings, &config, &crop);
+    if (usable)
+        switch_capture(source_data, &config, &crop, true);
+
+    obs_data_release(settings);
+    return usable;
 }
 
 /**
  * Update source data
  *
+ * Changes that only affect the plugin are applied to the running capture,
+ * anything else switches to another capture.
+ *
  * \author
  *   PancakeTAS
  *
@@ -164,22 +328,168 @@ static bool on_reload(obs_properties_t*, obs_property_t *, void *data) {
 static void update(void* data, obs_data_t* settings) {
     fbc_source* source_data = (fbc_source*) data;
 
-    // stop the source
-    obs_enter_graphics();
-    if (source_data->is_capturing) {
-        source_data->is_capturing = false;
+    capture_config config;
+    source_crop crop;
+    if (!read_config(source_data, settings, &config, &crop))
+        return;
+
+    // (a new area within the same capture is just drawn differently)
+    if (!source_data->async)
+        obs_enter_graphics();
+    pthread_mutex_lock(&source_data->lock);
+    track_area(source_data, settings);
+    bool applied = source_data->capture && !source_data->next && capture_reconfigure(source_data->capture, &config);
+    if (applied)
+        set_capture(source_data, source_data->capture, &crop);
+    pthread_mutex_unlock(&source_data->lock);
+    if (!source_data->async)
+        obs_leave_graphics();
+
+    if (!applied)
+        switch_capture(source_data, &config, &crop, false);
+}
+
+/**
+ * Report the capture-to-render latency through the proc handler
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param data
+ *   Source data
+ * \param cd
+ *   Call data
+ */
+static void get_capture_latency(void* data, calldata_t* cd) {
+    fbc_source* source_data = (fbc_source*) data;
+    pthread_mutex_lock(&source_data->lock);
+
+    capture_stats* stats = source_data->capture ? &source_data->capture->stats : NULL;
+    uint64_t frames = stats ? stats->latency_frames : 0;
+    calldata_set_int(cd, "last_ns", stats ? stats->latency_last : 0);
+    calldata_set_int(cd, "average_ns", frames ? stats->latency_total / frames : 0);
+    calldata_set_int(cd, "max_ns", stats ? stats->latency_max : 0);
+
+    pthread_mutex_unlock(&source_data->lock);
+}
+
+/**
+ * Report how the capture recovered from lost sessions through the proc handler
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param data
+ *   Source data
+ * \param cd
+ *   Call data
+ */
+static void get_recovery_stats(void* data, calldata_t* cd) {
+    fbc_source* source_data = (fbc_source*) data;
+    pthread_mutex_lock(&source_data->lock);
+
+    fbc_capture* capture = source_data->capture;
+    capture_stats* stats = capture ? &capture->stats : NULL;
+    uint64_t recoveries = stats ? atomic_load(&stats->recoveries) : 0;
+    uint64_t lost_at = capture ? atomic_load(&capture->lost_at) : 0;
+    calldata_set_int(cd, "recoveries", recoveries);
+    calldata_set_int(cd, "attempts", stats ? atomic_load(&stats->recovery_attempts) : 0);
+    calldata_set_int(cd, "failed_grabs", stats ? atomic_load(&stats->failed_grabs) : 0);
+    calldata_set_int(cd, "last_ns", stats ? atomic_load(&stats->recovery_last) : 0);
+    calldata_set_int(cd, "average_ns", recoveries ? atomic_load(&stats->recovery_total) / recoveries : 0);
+    calldata_set_int(cd, "max_ns", stats ? atomic_load(&stats->recovery_max) : 0);
+    calldata_set_int(cd, "lost_ns", lost_at ? os_gettime_ns() - lost_at : 0);
+
+    pthread_mutex_unlock(&source_data->lock);
+}
+
+/**
+ * Report how much of the frame changes through the proc handler
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param data
+ *   Source data
+ * \param cd
+ *   Call data
+ */
+static void get_changed_area(void* data, calldata_t* cd) {
+    fbc_source* source_data = (fbc_source*) data;
+    pthread_mutex_lock(&source_data->lock);
+
+    capture_stats* stats = source_data->capture ? &source_data->capture->stats : NULL;
+    uint64_t frames = stats ? stats->changed_frames : 0;
+    calldata_set_float(cd, "last", stats ? stats->changed_area : 1.0f);
+    calldata_set_float(cd, "average", frames ? stats->changed_total / frames : 1.0);
+    calldata_set_int(cd, "idle_frames", stats ? stats->idle_frames : 0);
 
-        // close the textures
-        gs_texture_destroy(source_data->textures[0]);
-        gs_texture_destroy(source_data->textures[1]);
+    pthread_mutex_unlock(&source_data->lock);
+}
 
-        stop_callback(&source_data->params);
+/**
+ * Report the timing histogram of a capture stage through the proc handler
+ *
+ * Render is timed per source. The other stages belong to the capture, which
+ * every source showing the same frames shares.
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param data
+ *   Source data
+ * \param cd
+ *   Call data
+ */
+static void get_stage_timings(void* data, calldata_t* cd) {
+    fbc_source* source_data = (fbc_source*) data;
+    timing_stage stage = timing_stage_from_name(calldata_string(cd, "stage"));
+    pthread_mutex_lock(&source_data->lock);
+    if (stage == STAGE_COUNT || (stage != STAGE_RENDER && !source_data->capture)) {
+        pthread_mutex_unlock(&source_data->lock);
+        calldata_set_int(cd, "count", 0);
+        return;
     }
-    obs_leave_graphics();
 
-    // then update the source data
-    source_data->params.frame_width = obs_data_get_int(settings, "width");
-    source_data->params.frame_height = obs_data_get_int(settings, "height");
+    const stage_timings* timings = stage == STAGE_RENDER ? &source_data->timings : &source_data->capture->timings;
+    const timing_histogram* histogram = &timings->stages[stage];
+    uint64_t count = atomic_load(&histogram->count);
+    calldata_set_int(cd, "count", count);
+    calldata_set_int(cd, "average_ns", count ? atomic_load(&histogram->total_ns) / count : 0);
+    calldata_set_int(cd, "p50_ns", timing_percentile(histogram, 50.0));
+    calldata_set_int(cd, "p99_ns", timing_percentile(histogram, 99.0));
+    calldata_set_int(cd, "p999_ns", timing_percentile(histogram, 99.9));
+    calldata_set_int(cd, "max_ns", atomic_load(&histogram->max_ns));
+    pthread_mutex_unlock(&source_data->lock);
+}
+
+/**
+ * Create the source data and register the proc handlers
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param source
+ *   OBS source
+ * \param async
+ *   Whether the source outputs async video from system memory
+ *
+ * \return
+ *   Source data
+ */
+static fbc_source* create_source(obs_source_t* source, bool async) {
+    fbc_source* source_data = bzalloc(sizeof(fbc_source));
+    source_data->source = source;
+    source_data->async = async;
+    pthread_mutex_init(&source_data->lock, NULL);
+
+    proc_handler_t* ph = obs_source_get_proc_handler(source);
+    if (!async)
+        proc_handler_add(ph, "void get_capture_latency(out int last_ns, out int average_ns, out int max_ns)", get_capture_latency, source_data);
+    proc_handler_add(ph, "void get_changed_area(out float last, out float average, out int idle_frames)", get_changed_area, source_data);
+    proc_handler_add(ph, "void get_recovery_stats(out int recoveries, out int attempts, out int failed_grabs, out int last_ns, out int average_ns, out int max_ns, out int lost_ns)", get_recovery_stats, source_data);
+    proc_handler_add(ph, "void get_stage_timings(in string stage, out int count, out int average_ns, out int p50_ns, out int p99_ns, out int p999_ns, out int max_ns)", get_stage_timings, source_data);
+    return source_data;
 }
 
 /**
@@ -194,14 +504,115 @@ static void update(void* data, obs_data_t* settings) {
  *   OBS source
  */
 static void* create(obs_data_t* settings, obs_source_t* source) {
-    fbc_source* source_data = bzalloc(sizeof(fbc_source));
-    source_data->source = source;
+    fbc_source* source_data = create_source(source, false);
 
     update(source_data, settings);
-    on_reload(NULL, NULL, source_data);
     return source_data;
 }
 
+/**
+ * Create and update new system memory source
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param settings
+ *   Settings of the source
+ * \param source
+ *   OBS source
+ */
+static void* create_sys(obs_data_t* settings, obs_source_t* source) {
+    fbc_source* source_data = create_source(source, true);
+
+    update(source_data, settings);
+    return source_data;
+}
+
+/**
+ * Swap in a texture capture once its session is built
+ *
+ * Also recovers texture captures that lost their session and rebuilds the
+ * session when the monitor layout changed the area the source tracks.
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param data
+ *   Source data
+ * \param seconds
+ *   Time since the last tick
+ */
+static void video_tick(void* data, float seconds) {
+    fbc_source* source_data = (fbc_source*) data;
+
+    // NvFBC doesn't follow monitor changes, so check whether the tracked area moved
+    uint64_t generation = randr_generation();
+    obs_data_t* settings = generation != source_data->randr_generation ? obs_source_get_settings(source_data->source) : NULL;
+
+    // (unless update() is busy queueing a newer capture)
+    if (pthread_mutex_trylock(&source_data->lock)) {
+        obs_data_release(settings);
+        return;
+    }
+
+    bool moved = false;
+    if (settings) {
+        moved = track_area(source_data, settings);
+        source_data->randr_generation = generation;
+    }
+
+    // the graphics context has to be entered before the lock, so only look for work here
+    fbc_capture* next = source_data->next;
+    fbc_capture* capture = source_data->capture;
+    bool busy = (next && atomic_load(&next->state) != CAPTURE_STARTING)
+        || (capture && !source_data->async && capture_needs_recovery(capture));
+    pthread_mutex_unlock(&source_data->lock);
+
+    bool fallback = false;
+    if (busy) {
+        obs_enter_graphics();
+        if (!pthread_mutex_trylock(&source_data->lock)) {
+            next = source_data->next;
+            if (next && atomic_load(&next->state) != CAPTURE_STARTING) {
+                fbc_capture* retired = source_data->capture;
+                if (capture_activate(next))
+                    set_capture(source_data, next, &source_data->next_crop);
+                else
+                    retired = next;
+                source_data->next = NULL;
+
+                // the backend gave up on sharing the buffers, so the source needs a capture that keeps its own
+                if (retired == next && next->config.params.opaque_buffers != next->key.params.opaque_buffers) {
+                    source_data->opaque_buffers = true;
+                    fallback = true;
+                }
+
+                // the old capture kept producing frames until now
+                if (retired)
+                    capture_release(retired);
+            }
+
+            // (a shared capture is recovered by whichever source gets to it first)
+            capture = source_data->capture;
+            if (capture && !source_data->async && capture_needs_recovery(capture))
+                capture_recover(capture);
+            if (capture && capture->config.params.opaque_buffers != capture->key.params.opaque_buffers)
+                source_data->opaque_buffers = true;
+
+            pthread_mutex_unlock(&source_data->lock);
+        }
+        obs_leave_graphics();
+    }
+
+    if (moved)
+        blog(LOG_INFO, "Tracked area of %s changed, rebuilding the session", obs_source_get_name(source_data->source));
+    if (fallback)
+        blog(LOG_WARNING, "Failed to share the capture buffers of %s as DMA-BUFs, rebuilding the session with the backend's own buffers", obs_source_get_name(source_data->source));
+    if (moved || fallback)
+        on_reload(NULL, NULL, source_data);
+    obs_data_release(settings);
+}
+
 /**
  * Render the source
  *
@@ -215,18 +626,34 @@ static void* create(obs_data_t* settings, obs_source_t* source) {
  */
 static void render(void* data, gs_effect_t* effect) {
     fbc_source* source_data = (fbc_source*) data;
-    if (!source_data->is_capturing)
+    fbc_capture* capture = source_data->capture;
+    if (!capture)
         return;
 
-    // capture a frame
-    capture_callback(&source_data->params);
+    // every source sharing the capture shows the same frame
+    gs_texture_t* texture = capture_render_frame(capture);
 
     // render the frame
+    uint64_t start = timing_begin(STAGE_RENDER);
     effect = obs_get_base_effect(OBS_EFFECT_OPAQUE);
-    gs_effect_set_texture(gs_effect_get_param_by_name(effect, "image"), source_data->textures[source_data->params.current_texture]);
+    gs_effect_set_texture(gs_effect_get_param_by_name(effect, "image"), texture);
 
-    while (gs_effect_loop(effect, "Draw"))
-        gs_draw_sprite(source_data->textures[source_data->params.current_texture], 0, source_data->params.frame_width, source_data->params.frame_height);
+    // crops of a shared capture only sample their area, scaled to the frame size
+    const source_crop* crop = &source_data->crop;
+    if (crop->enabled) {
+        gs_matrix_push();
+        gs_matrix_scale3f(crop->frame_width / (float) crop->width, crop->frame_height / (float) crop->height, 1.0f);
+    }
+    while (gs_effect_loop(effect, "Draw")) {
+        if (crop->enabled)
+            gs_draw_sprite_subregion(texture, 0, crop->x, crop->y, crop->width, crop->height);
+        else
+            gs_draw_sprite(texture, 0, capture->config.params.frame_width, capture->config.params.frame_height);
+    }
+    if (crop->enabled)
+        gs_matrix_pop();
+    capture_sampled(capture);
+    timing_end(&source_data->timings, STAGE_RENDER, start);
 }
 
 /**
@@ -246,6 +673,38 @@ static bool on_direct_update(obs_properties_t* props, obs_property_t*, obs_data_
     return true;
 }
 
+/**
+ * Update properties window on capture_thread click
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param props
+ *   Properties of the source
+ * \param settings
+ *   Settings of the source
+ */
+static bool on_thread_update(obs_properties_t* props, obs_property_t*, obs_data_t* settings) {
+    obs_property_set_visible(obs_properties_get(props, "grab_mode"), obs_data_get_bool(settings, "capture_thread"));
+    return true;
+}
+
+/**
+ * Update properties window on with_diffmap click
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param props
+ *   Properties of the source
+ * \param settings
+ *   Settings of the source
+ */
+static bool on_diffmap_update(obs_properties_t* props, obs_property_t*, obs_data_t* settings) {
+    obs_property_set_visible(obs_properties_get(props, "diffmap_scale"), obs_data_get_bool(settings, "with_diffmap"));
+    return true;
+}
+
 /**
  * Update properties window on crop click
  *
@@ -271,7 +730,8 @@ static bool on_crop_update(obs_properties_t* props, obs_property_t*, obs_data_t*
  * \return
  *   Properties of the source
  */
-static obs_properties_t* get_properties(void* unused) {
+static obs_properties_t* get_properties(void* data) {
+    fbc_source* source_data = (fbc_source*) data;
     obs_properties_t* props = obs_properties_create();
 
     // tracking type
@@ -279,28 +739,57 @@ static obs_properties_t* get_properties(void* unused) {
     obs_property_list_add_string(prop, "Primary Screen", "0");
     obs_property_list_add_string(prop, "Entire X Screen", "2");
 
-    // output list
-    xcb_connection_t* conn = xcb_connect(NULL, NULL);
-    xcb_randr_get_monitors_reply_t* monitors = xcb_randr_get_monitors_reply(conn, xcb_randr_get_monitors(conn, xcb_setup_roots_iterator(xcb_get_setup(conn)).data->root, 1), NULL);
-    xcb_randr_monitor_info_iterator_t iter = xcb_randr_get_monitors_monitors_iterator(monitors);
-    for (; iter.rem; xcb_randr_monitor_info_next(&iter)) {
-        xcb_randr_monitor_info_t* monitor = iter.data;
-
-        xcb_get_atom_name_reply_t* name = xcb_get_atom_name_reply(conn, xcb_get_atom_name(conn, monitor->name), NULL);
-        char name_str[128];
-        sprintf(name_str, "%.*s: %dx%d+%d+%d", name->name_len, xcb_get_atom_name_name(name), monitor->width, monitor->height, monitor->x, monitor->y);
+    // output list (from the cache kept up to date by the RandR listener)
+    randr_monitor monitors[RANDR_MAX_MONITORS];
+    int count = randr_get_monitors(monitors);
+    for (int i = 0; i < count; i++) {
+        char name_str[192];
+        snprintf(name_str, sizeof(name_str), "%s: %dx%d+%d+%d", monitors[i].name, monitors[i].width, monitors[i].height, monitors[i].x, monitors[i].y);
         obs_property_list_add_string(prop, name_str, name_str);
-
-        free(name);
     }
 
-    xcb_disconnect(conn);
-    free(monitors);
-
     prop = obs_properties_add_bool(props, "direct_capture", "Allow direct capture");
     obs_property_set_modified_callback(prop, on_direct_update);
     obs_properties_add_bool(props, "with_cursor", "Track Cursor");
 
+    // capture backend
+    prop = obs_properties_add_list(props, "backend", "Capture Backend", OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_STRING);
+    obs_property_list_add_string(prop, "Automatic", "auto");
+    uint32_t required = source_data && source_data->async ? BACKEND_CAP_SYSTEM_MEMORY : BACKEND_CAP_TEXTURE;
+    for (int i = 0; backend_get(i); i++)
+        if ((backend_get(i)->capabilities() & required) == required)
+            obs_property_list_add_string(prop, backend_get(i)->name, backend_get(i)->id);
+
+    // capture timing (system memory sources always capture on their own thread)
+    if (!source_data || !source_data->async) {
+        prop = obs_properties_add_bool(props, "capture_thread", "Capture on a separate thread");
+        obs_property_set_modified_callback(prop, on_thread_update);
+    }
+    prop = obs_properties_add_list(props, "grab_mode", "Grab Mode", OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+    obs_property_list_add_int(prop, "Don't wait (latest frame)", GRAB_MODE_NOWAIT);
+    obs_property_list_add_int(prop, "Wait unless a new frame is ready", GRAB_MODE_NOWAIT_IF_NEW_FRAME_READY);
+    obs_property_list_add_int(prop, "Wait for the next frame", GRAB_MODE_BLOCKING);
+    obs_properties_add_bool(props, "use_timestamps", "Schedule frames by capture time");
+    if (!source_data || !source_data->async)
+        obs_properties_add_bool(props, "dmabuf_modifiers", "Share capture buffers as DMA-BUFs (experimental)");
+
+    // output format (system memory sources only)
+    if (source_data && source_data->async) {
+        prop = obs_properties_add_list(props, "pixel_format", "Pixel Format", OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+        obs_property_list_add_int(prop, "BGRA", PIXEL_FORMAT_BGRA);
+        obs_property_list_add_int(prop, "NV12 (BT.709)", PIXEL_FORMAT_NV12);
+        obs_property_list_add_int(prop, "I444 (BT.709)", PIXEL_FORMAT_I444);
+    }
+
+    // change tracking
+    prop = obs_properties_add_bool(props, "with_diffmap", "Track changed regions");
+    obs_property_set_modified_callback(prop, on_diffmap_update);
+    prop = obs_properties_add_list(props, "diffmap_scale", "Change Tracking Block Size", OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+    obs_property_list_add_int(prop, "8x8", 8);
+    obs_property_list_add_int(prop, "16x16", 16);
+    obs_property_list_add_int(prop, "32x32", 32);
+    obs_property_list_add_int(prop, "64x64", 64);
+
     // capture area
     prop = obs_properties_add_bool(props, "crop_area", "Crop capture area");
     obs_property_set_modified_callback(prop, on_crop_update);
@@ -309,6 +798,8 @@ static obs_properties_t* get_properties(void* unused) {
     obs_properties_add_int(crop_props, "capture_y", "Capture Y", 0, 4096, 2);
     obs_properties_add_int(crop_props, "capture_width", "Capture Width", 0, 4096, 2);
     obs_properties_add_int(crop_props, "capture_height", "Capture Height", 0, 4096, 2);
+    if (!source_data || !source_data->async)
+        obs_properties_add_bool(crop_props, "crop_shared", "Cut from a shared capture of the whole screen");
     obs_properties_add_group(props, "capture_area", "Capture Area", OBS_GROUP_NORMAL, crop_props);
 
     // frame size
@@ -342,6 +833,7 @@ static void get_defaults(obs_data_t* settings) {
     obs_data_set_default_int(settings, "capture_y", 0);
     obs_data_set_default_int(settings, "capture_width", 1920);
     obs_data_set_default_int(settings, "capture_height", 1080);
+    obs_data_set_default_bool(settings, "crop_shared", false);
 
     // frame size
     obs_data_set_default_int(settings, "width", 1920);
@@ -350,6 +842,14 @@ static void get_defaults(obs_data_t* settings) {
     // misc capture options
     obs_data_set_default_bool(settings, "with_cursor", true);
     obs_data_set_default_int(settings, "sampling_rate", 16);
+    obs_data_set_default_int(settings, "grab_mode", GRAB_MODE_NOWAIT);
+    obs_data_set_default_bool(settings, "capture_thread", false);
+    obs_data_set_default_bool(settings, "use_timestamps", false);
+    obs_data_set_default_bool(settings, "dmabuf_modifiers", false);
+    obs_data_set_default_bool(settings, "with_diffmap", false);
+    obs_data_set_default_string(settings, "backend", "auto");
+    obs_data_set_default_int(settings, "pixel_format", PIXEL_FORMAT_BGRA);
+    obs_data_set_default_int(settings, "diffmap_scale", 16);
 }
 
 /**
@@ -364,19 +864,20 @@ static void get_defaults(obs_data_t* settings) {
 static void destroy(void* data) {
     fbc_source* source_data = (fbc_source*) data;
 
-    // stop the source
-    obs_enter_graphics();
-    if (source_data->is_capturing) {
-        source_data->is_capturing = false;
-
-        // close the textures
-        gs_texture_destroy(source_data->textures[0]);
-        gs_texture_destroy(source_data->textures[1]);
-
-        stop_callback(&source_data->params);
-    }
-    obs_leave_graphics();
-
+    // release the captures (texture captures are stopped on the graphics thread)
+    if (!source_data->async)
+        obs_enter_graphics();
+    pthread_mutex_lock(&source_data->lock);
+    if (source_data->next)
+        capture_release(source_data->next);
+    if (source_data->capture)
+        capture_release(source_data->capture);
+    pthread_mutex_unlock(&source_data->lock);
+    if (!source_data->async)
+        obs_leave_graphics();
+
+    timing_log(&source_data->timings, obs_source_get_name(source_data->source));
+    pthread_mutex_destroy(&source_data->lock);
     bfree(data);
 }
 
@@ -393,6 +894,7 @@ static struct obs_source_info nvfbc_source = {
     .create = create,
     .update = update,
     .destroy = destroy,
+    .video_tick = video_tick,
     .video_render = render,
 
     .get_properties = get_properties,
@@ -402,9 +904,28 @@ static struct obs_source_info nvfbc_source = {
     .get_height = get_height,
 };
 
-void register_fbc_source(void(*new_start_callback)(capture_params*), void(*new_capture_callback)(capture_params*), void(*new_stop_callback)(capture_params*)) {
-    start_callback = new_start_callback;
-    capture_callback = new_capture_callback;
-    stop_callback = new_stop_callback;
-    obs_register_source(&nvfbc_source);
+/// Struct describing the NvFBC system memory source
+static struct obs_source_info nvfbc_sys_source = {
+    .id = "nvfbc-sys-source",
+    .version = 1,
+    .get_name = get_sys_name,
+
+    .type = OBS_SOURCE_TYPE_INPUT,
+    .output_flags = OBS_SOURCE_ASYNC_VIDEO | OBS_SOURCE_SRGB,
+    .icon_type = OBS_ICON_TYPE_DESKTOP_CAPTURE,
+
+    .create = create_sys,
+    .update = update,
+    .destroy = destroy,
+    .video_tick = video_tick,
+
+    .get_properties = get_properties,
+    .get_defaults = get_defaults,
+};
+
+void register_fbc_sources() {
+    if (backend_find(NULL, BACKEND_CAP_TEXTURE))
+        obs_register_source(&nvfbc_source);
+    if (backend_find(NULL, BACKEND_CAP_SYSTEM_MEMORY))
+        obs_register_source(&nvfbc_sys_source);
 }
@@ -1,9 +1,26 @@
 #pragma once
 
+#include "timing.h"
+
 #include <GL/gl.h>
 #include <stdint.h>
 #include <stdbool.h>
 
+#define MAX_BUFFERS 4 //!< Maximum number of buffers a texture backend captures into
+#define MAX_MODIFIERS 32 //!< Maximum number of DRM format modifiers a texture capture can offer for its buffers
+
+typedef enum {
+    GRAB_MODE_NOWAIT, //!< Return the latest frame immediately
+    GRAB_MODE_NOWAIT_IF_NEW_FRAME_READY, //!< Return immediately if an unseen frame is ready, otherwise wait for a new one
+    GRAB_MODE_BLOCKING //!< Always wait for a new frame
+} grab_mode; //!< NvFBC grab mode
+
+typedef enum {
+    PIXEL_FORMAT_BGRA, //!< Packed BGRA, 32 bpp
+    PIXEL_FORMAT_NV12, //!< BT.709 Y plane followed by interleaved UV at half resolution, 12 bpp
+    PIXEL_FORMAT_I444 //!< BT.709 Y, U and V planes at full resolution, 24 bpp
+} pixel_format; //!< Pixel format of frames in system memory
+
 typedef struct {
     int tracking_type; //!< Tracking type
     char display_name[256]; //!< Display name (for tracking type 1)
@@ -14,24 +31,27 @@ typedef struct {
     bool push_model; //!< Whether to use the push model
     int sampling_rate; //!< Sampling rate in ms (only for tracking type 1)
     bool direct_mode; //!< Whether to allow direct mode
+    grab_mode mode; //!< How to wait for new frames
+    bool threaded; //!< Whether grabs run on a capture thread (otherwise on the graphics thread, which must never wait for the GPU)
+    bool with_diffmap; //!< Whether to generate differential maps
+    int diffmap_scale; //!< Width and height of the pixel block one diffmap entry covers
 
-    GLuint textures[2]; //!< GL textures to render to
-    int current_texture; //!< Pointer to the index of the texture to render
+    int texture_count; //!< Number of GL textures backing the frames
+    GLuint textures[MAX_BUFFERS]; //!< GL textures to render to
+    int diffmap_width, diffmap_height; //!< Size of the differential map
+    pixel_format format; //!< Pixel format of frames in system memory
+    bool opaque_buffers; //!< Whether the backend keeps its own capture buffers instead of creating them to be shared as DMA-BUFs (set by the backend if sharing failed)
+    uint64_t modifiers[MAX_MODIFIERS]; //!< DRM format modifiers the capture buffers may be created with (queried on the graphics thread)
+    int modifier_count; //!< Number of modifiers (0 leaves the backend's buffers alone)
 
+    stage_timings* timings; //!< Stage timings of the source (may be NULL)
     void* user_data; //!< User data
 } capture_params; //!< Capture parameters
 
 /**
- * Register the source
+ * Register the sources backed by the usable capture backends
  *
  * \author
  *   PancakeTAS
- *
- * \param start_callback
- *   Callback to start capturing
- * \param capture_callback
- *   Callback to capture a frame (shall not block)
- * \param stop_callback
- *   Callback to stop capturing
  */
-void register_fbc_source(void(*start_callback)(capture_params*), void(*capture_callback)(capture_params*), void(*stop_callback)(capture_params*));
+void register_fbc_sources();
@@ -0,0 +1,118 @@
+#include "timing.h"
+
+#include <obs/obs-module.h>
+#include <obs/util/platform.h>
+#include <obs/util/profiler.h>
+#include <inttypes.h>
+#include <string.h>
+
+/// Names of the stages (also used as profiler scope names, which have to be static)
+static const char* stage_names[STAGE_COUNT] = {
+    "nvfbc: setup",
+    "nvfbc: swap",
+    "nvfbc: bind",
+    "nvfbc: grab",
+    "nvfbc: release",
+    "nvfbc: render",
+    "nvfbc: output",
+    "nvfbc: sync"
+};
+
+/**
+ * Return the bucket of a sample
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param ns
+ *   Sample in ns
+ *
+ * \return
+ *   Index of the bucket
+ */
+static int bucket_of(uint64_t ns) {
+    if (ns < TIMING_SUB_BUCKETS)
+        return (int) ns;
+
+    int octave = 63 - __builtin_clzll(ns);
+    int sub = (int) ((ns >> (octave - 2)) & (TIMING_SUB_BUCKETS - 1));
+    return (octave - 1) * TIMING_SUB_BUCKETS + sub;
+}
+
+/**
+ * Return the upper bound of a bucket
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param bucket
+ *   Index of the bucket
+ *
+ * \return
+ *   Largest sample in the bucket in ns
+ */
+static uint64_t bucket_limit(int bucket) {
+    if (bucket < TIMING_SUB_BUCKETS)
+        return bucket;
+
+    int octave = bucket / TIMING_SUB_BUCKETS + 1;
+    int sub = bucket % TIMING_SUB_BUCKETS;
+    return ((uint64_t) (TIMING_SUB_BUCKETS + sub + 1) << (octave - 2)) - 1;
+}
+
+uint64_t timing_begin(timing_stage stage) {
+    profile_start(stage_names[stage]);
+    return os_gettime_ns();
+}
+
+void timing_end(stage_timings* timings, timing_stage stage, uint64_t start) {
+    uint64_t ns = os_gettime_ns() - start;
+    profile_end(stage_names[stage]);
+    if (!timings)
+        return;
+
+    timing_histogram* histogram = &timings->stages[stage];
+    atomic_fetch_add_explicit(&histogram->buckets[bucket_of(ns)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->total_ns, ns, memory_order_relaxed);
+
+    uint64_t max = atomic_load_explicit(&histogram->max_ns, memory_order_relaxed);
+    while (ns > max && !atomic_compare_exchange_weak_explicit(&histogram->max_ns, &max, ns, memory_order_relaxed, memory_order_relaxed));
+}
+
+uint64_t timing_percentile(const timing_histogram* histogram, double percentile) {
+    uint64_t count = atomic_load_explicit(&histogram->count, memory_order_relaxed);
+    if (!count)
+        return 0;
+
+    // walk the buckets until the percentile is covered
+    uint64_t target = (uint64_t) (percentile / 100.0 * count + 0.5);
+    uint64_t seen = 0;
+    for (int i = 0; i < TIMING_BUCKETS; i++) {
+        seen += atomic_load_explicit(&histogram->buckets[i], memory_order_relaxed);
+        if (seen >= target && seen)
+            return bucket_limit(i);
+    }
+    return atomic_load_explicit(&histogram->max_ns, memory_order_relaxed);
+}
+
+timing_stage timing_stage_from_name(const char* name) {
+    for (int i = 0; i < STAGE_COUNT; i++)
+        if (name && !strcmp(name, stage_names[i] + strlen("nvfbc: ")))
+            return (timing_stage) i;
+    return STAGE_COUNT;
+}
+
+void timing_log(const stage_timings* timings, const char* owner) {
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        const timing_histogram* histogram = &timings->stages[i];
+        uint64_t count = atomic_load_explicit(&histogram->count, memory_order_relaxed);
+        if (!count)
+            continue;
+
+        blog(LOG_INFO, "[%s] %s: %" PRIu64 " calls, %.3f ms average, %.3f ms p50, %.3f ms p99, %.3f ms p99.9, %.3f ms max",
+            owner, stage_names[i], count, atomic_load_explicit(&histogram->total_ns, memory_order_relaxed) / (double) count / 1000000.0,
+            timing_percentile(histogram, 50.0) / 1000000.0, timing_percentile(histogram, 99.0) / 1000000.0,
+            timing_percentile(histogram, 99.9) / 1000000.0, atomic_load_explicit(&histogram->max_ns, memory_order_relaxed) / 1000000.0);
+    }
+}
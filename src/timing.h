@@ -0,0 +1,104 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#define TIMING_SUB_BUCKETS 4 //!< Linear buckets per power of two
+#define TIMING_BUCKETS (64 * TIMING_SUB_BUCKETS) //!< Number of histogram buckets
+
+typedef enum {
+    STAGE_SETUP, //!< Session setup off the graphics thread
+    STAGE_SWAP, //!< Texture creation and export when a new session is swapped in
+    STAGE_BIND, //!< NvFBC context bind
+    STAGE_GRAB, //!< Frame grab
+    STAGE_RELEASE, //!< NvFBC context release
+    STAGE_RENDER, //!< Texture draw in render()
+    STAGE_OUTPUT, //!< Handing a system memory frame to OBS
+    STAGE_SYNC, //!< Waiting for OBS to finish sampling the buffer NvFBC captures into next, and for NvFBC to finish writing it
+    STAGE_COUNT
+} timing_stage; //!< Timed stage of the capture
+
+typedef struct {
+    atomic_uint_fast64_t buckets[TIMING_BUCKETS]; //!< Number of samples per bucket
+    atomic_uint_fast64_t count; //!< Number of samples
+    atomic_uint_fast64_t total_ns; //!< Sum of all samples in ns
+    atomic_uint_fast64_t max_ns; //!< Highest sample in ns
+} timing_histogram; //!< Lock-free latency histogram (buckets are a quarter of a power of two wide)
+
+typedef struct {
+    timing_histogram stages[STAGE_COUNT]; //!< Histogram per stage
+} stage_timings; //!< Timings of all stages of a capture or source
+
+/**
+ * Start timing a stage
+ *
+ * This also opens the stage's OBS profiler scope.
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param stage
+ *   Stage to time
+ *
+ * \return
+ *   Start time to pass to timing_end()
+ */
+uint64_t timing_begin(timing_stage stage);
+
+/**
+ * Stop timing a stage and record the sample
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param timings
+ *   Timings to record into (may be NULL to only close the profiler scope)
+ * \param stage
+ *   Timed stage
+ * \param start
+ *   Start time returned by timing_begin()
+ */
+void timing_end(stage_timings* timings, timing_stage stage, uint64_t start);
+
+/**
+ * Estimate a percentile of a histogram
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param histogram
+ *   Histogram
+ * \param percentile
+ *   Percentile (0 to 100)
+ *
+ * \return
+ *   Upper bound of the bucket holding the percentile in ns, 0 without samples
+ */
+uint64_t timing_percentile(const timing_histogram* histogram, double percentile);
+
+/**
+ * Return the stage a name refers to
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param name
+ *   Name of the stage (e.g. "grab")
+ *
+ * \return
+ *   Stage, or STAGE_COUNT if the name is unknown
+ */
+timing_stage timing_stage_from_name(const char* name);
+
+/**
+ * Log the timings of every stage that has samples
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param timings
+ *   Timings to log
+ * \param owner
+ *   Name of the capture or source the timings belong to
+ */
+void timing_log(const stage_timings* timings, const char* owner);
@@ -0,0 +1,709 @@
+#include "hooks/hooks.h"
+#include "backend.h"
+#include "session.h"
+
+#include <vulkan/vulkan.h>
+#include <obs/obs-module.h>
+#include <EGL/egl.h>
+#include <libdrm/drm_fourcc.h>
+#include <NvFBC.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#define IMPORT_CACHE_SIZE (HOOKS_MAX_SESSIONS * NVFBC_TOGL_TEXTURES_MAX) //!< Number of imported buffers kept, enough for every session slot
+#define SAMPLE_TIMEOUT_NS 100000000 //!< Longest wait for OBS's reads of a buffer before NvFBC captures into it anyway
+
+typedef struct {
+    VkDeviceMemory memory; //!< Imported buffer
+    uint64_t size; //!< Size of the buffer
+    GLuint memory_object; //!< Memory object holding the import (0 if the entry is unused)
+    int refs; //!< Number of sessions using the import
+    uint64_t frees; //!< Number of frees the hooks had seen when the import was last checked (see hooks_freed_since())
+} import_entry; //!< Buffer imported into GL
+
+typedef struct {
+    fbc_session session; //!< NvFBC session
+    void* diffmap; //!< Differential map buffer (owned and reallocated by NvFBC)
+    GLuint memory_objects[NVFBC_TOGL_TEXTURES_MAX]; //!< Imports backing the textures (see acquire_import())
+    hook_session* buffers; //!< Slot the preload hooks (or the Vulkan layer) recorded the session's capture buffers into
+    bool lost; //!< Whether the session failed to start or was lost
+    bool dmabuf_failed; //!< Whether sharing one of the session's buffers as a DMA-BUF failed
+    pthread_mutex_t fence_lock; //!< Lock protecting display and fences (the graphics thread sets them, the grabbing thread takes them)
+    EGLDisplay display; //!< Display of OBS's graphics context
+    EGLSync fences[NVFBC_TOGL_TEXTURES_MAX]; //!< Fences signaled once the GPU finished OBS's reads of each buffer (EGL_NO_SYNC if none are pending)
+    int next_texture; //!< Buffer NvFBC captures into next (the one it didn't return last)
+    PFN_vkDeviceWaitIdle device_wait_idle; //!< vkDeviceWaitIdle of NvFBC's device (NULL if it couldn't be loaded)
+    backend_stats stats; //!< Statistics since start
+} nvfbc_user; //!< NvFBC user data
+
+void* (*glCreateMemoryObjectsEXT)(GLsizei, GLuint*) = NULL; //!< glCreateMemoryObjectsEXT function pointer
+void* (*glMemoryObjectParameterivEXT)(GLuint, GLenum, const GLint*) = NULL; //!< glMemoryObjectParameterivEXT function pointer
+void* (*glImportMemoryFdEXT)(GLuint, GLuint64, GLenum, GLint) = NULL; //!< glImportMemoryFdEXT function pointer
+void* (*glTextureStorageMem2DEXT)(GLuint, GLsizei, GLenum, GLsizei, GLsizei, GLuint, GLuint64) = NULL; //!< glTextureStorageMem2DEXT function pointer
+void* (*glDeleteMemoryObjectsEXT)(GLsizei, const GLuint*) = NULL; //!< glDeleteMemoryObjectsEXT function pointer
+
+static import_entry imports[IMPORT_CACHE_SIZE]; //!< Buffers imported into GL (graphics thread only)
+
+/**
+ * Return the capabilities of the ToGL backend
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \return
+ *   Capabilities, 0 without NvFBC or without the preload hooks or the Vulkan layer
+ */
+static uint32_t togl_capabilities() {
+    if (!fbc.nvFBCCreateHandle || !backend_hooks())
+        return 0;
+
+    return BACKEND_CAP_TEXTURE | BACKEND_CAP_DIFFMAP;
+}
+
+/**
+ * Claim a slot for the preload hooks to record the calling thread's allocations into
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param hooks
+ *   Hook state
+ * \param modifiers
+ *   DRM format modifiers OBS can import BGRA frames with, NvFBC's images are created with one of them
+ * \param modifier_count
+ *   Number of modifiers (0 leaves NvFBC's images alone)
+ *
+ * \return
+ *   Session slot, or NULL if all slots are in use
+ */
+static hook_session* claim_buffers(NvFBCCustomState* hooks, const uint64_t* modifiers, int modifier_count) {
+    for (int i = 0; i < HOOKS_MAX_SESSIONS; i++) {
+        hook_session* slot = &hooks->sessions[i];
+        int expected = HOOK_SESSION_FREE;
+        if (!atomic_compare_exchange_strong(&slot->state, &expected, HOOK_SESSION_CLAIMED))
+            continue;
+
+        // (the hooks only look at the slot once it is recording)
+        slot->owner = pthread_self();
+        slot->instance = VK_NULL_HANDLE;
+        slot->device = VK_NULL_HANDLE;
+        slot->count = 0;
+        memcpy(slot->modifiers, modifiers, modifier_count * sizeof(uint64_t));
+        slot->modifier_count = modifier_count;
+        slot->image_count = 0;
+        memset(slot->bound, 0, sizeof(slot->bound));
+        atomic_store_explicit(&slot->state, HOOK_SESSION_RECORDING, memory_order_release);
+        return slot;
+    }
+    return NULL;
+}
+
+/**
+ * Query the DRM format modifiers OBS can import BGRA frames with
+ *
+ * The startup thread must never enter the graphics context (the graphics
+ * thread may be waiting for it), so the modifiers are queried before the
+ * session is built.
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param params
+ *   Capture parameters
+ */
+static void prepare_capture(capture_params* params) {
+    params->modifier_count = 0;
+    if (params->opaque_buffers)
+        return;
+
+    uint64_t* supported = NULL;
+    size_t supported_count = 0;
+    bool queried = gs_query_dmabuf_modifiers_for_format(DRM_FORMAT_ARGB8888, &supported, &supported_count);
+
+    // (the implicit modifier would leave the tiling to the driver again)
+    for (size_t i = 0; queried && i < supported_count && params->modifier_count < MAX_MODIFIERS; i++) {
+        if (supported[i] != DRM_FORMAT_MOD_INVALID)
+            params->modifiers[params->modifier_count++] = supported[i];
+    }
+    bfree(supported);
+}
+
+/**
+ * Create the NvFBC session and set up ToGL capture
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param params
+ *   Capture parameters
+ * \param user_data
+ *   NvFBC user data
+ *
+ * \return
+ *   True if the capture was set up, false otherwise
+ */
+static bool setup_capture(capture_params* params, nvfbc_user* user_data) {
+    // create NvFBC session
+    if (!session_create(&user_data->session, params, NVFBC_CAPTURE_TO_GL))
+        return false;
+
+    // setup ToGL capture (it does absolutely nothing, apart from the diffmap)
+    NVFBC_TOGL_SETUP_PARAMS setup_params = {
+        .dwVersion = NVFBC_TOGL_SETUP_PARAMS_VER,
+        .eBufferFormat = NVFBC_BUFFER_FORMAT_BGRA,
+        .bWithDiffMap = params->with_diffmap,
+        .ppDiffMap = &user_data->diffmap,
+        .dwDiffMapScalingFactor = params->diffmap_scale
+    };
+    NVFBCSTATUS status = fbc.nvFBCToGLSetUp(user_data->session.handle, &setup_params);
+    if (status) {
+        blog(LOG_ERROR, "Failed to setup NvFBC ToGL capture: %d", status);
+        return false;
+    }
+    params->diffmap_width = params->with_diffmap ? setup_params.diffMapSize.w : 0;
+    params->diffmap_height = params->with_diffmap ? setup_params.diffMapSize.h : 0;
+    return true;
+}
+
+/**
+ * Start capture
+ *
+ * The NvFBC context stays bound to the calling thread until release_capture() is called.
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param params
+ *   Capture parameters
+ */
+static void start_capture(capture_params* params) {
+    blog(LOG_INFO, "Starting capture");
+
+    nvfbc_user* user_data = (nvfbc_user*) calloc(1, sizeof(nvfbc_user));
+    pthread_mutex_init(&user_data->fence_lock, NULL);
+    params->user_data = user_data;
+
+    // the hooks record the buffers NvFBC allocates on this thread while the session is set up,
+    // and create its images with a modifier OBS can import (unless sharing them failed for this source before)
+    int modifier_count = params->opaque_buffers ? 0 : params->modifier_count;
+    if (modifier_count > HOOKS_MAX_MODIFIERS)
+        modifier_count = HOOKS_MAX_MODIFIERS;
+    user_data->buffers = claim_buffers((NvFBCCustomState*) backend_hooks(), params->modifiers, modifier_count);
+    if (!user_data->buffers) {
+        blog(LOG_ERROR, "Too many ToGL captures, at most %d can run at once", HOOKS_MAX_SESSIONS);
+        user_data->lost = true;
+        return;
+    }
+    bool started = setup_capture(params, user_data);
+    atomic_store_explicit(&user_data->buffers->state, HOOK_SESSION_RECORDED, memory_order_release);
+
+    if (started && user_data->buffers->count < NVFBC_TOGL_TEXTURES_MAX) {
+        blog(LOG_ERROR, "NvFBC allocated %d of %d capture buffers", user_data->buffers->count, NVFBC_TOGL_TEXTURES_MAX);
+        started = false;
+    }
+    if (started)
+        user_data->device_wait_idle = (PFN_vkDeviceWaitIdle) vkGetInstanceProcAddr(user_data->buffers->instance, "vkDeviceWaitIdle");
+    user_data->lost = !started;
+}
+
+/**
+ * Delete an import
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param entry
+ *   Import no session uses anymore
+ */
+static void drop_import(import_entry* entry) {
+    glDeleteMemoryObjectsEXT(1, &entry->memory_object);
+    *entry = (import_entry) { 0 };
+}
+
+/**
+ * Import a capture buffer into a GL memory object, or reuse an earlier import of it
+ *
+ * Imports are dropped once their own buffer was freed, the handle may come
+ * back for a different buffer. Frees of other buffers leave them cached.
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param hooks
+ *   Hook state
+ * \param buffers
+ *   Capture buffers of the session
+ * \param index
+ *   Index of the buffer
+ *
+ * \return
+ *   Memory object, or 0 if the import failed
+ */
+static GLuint acquire_import(NvFBCCustomState* hooks, hook_session* buffers, int index) {
+    uint64_t frees = atomic_load_explicit(&hooks->frees, memory_order_acquire);
+    import_entry* free_entry = NULL;
+    for (int i = 0; i < IMPORT_CACHE_SIZE; i++) {
+        import_entry* entry = &imports[i];
+
+        // (imports in use are checked too, so their history doesn't fall behind)
+        bool freed = entry->memory_object && hooks_freed_since(hooks, entry->memory, &entry->frees);
+        if (freed && !entry->refs)
+            drop_import(entry);
+        if (!entry->memory_object) {
+            if (!free_entry)
+                free_entry = entry;
+            continue;
+        }
+
+        if (!freed && entry->memory == buffers->memory[index] && entry->size == buffers->size[index]) {
+            blog(LOG_DEBUG, "Reusing the GL import of capture buffer %d (%d sessions use it)", index, entry->refs);
+            entry->refs++;
+            return entry->memory_object;
+        }
+    }
+    if (!free_entry) {
+        blog(LOG_ERROR, "Too many imported capture buffers");
+        return 0;
+    }
+
+    // grab vulkan memory fd
+    VkResult (*vkGetMemoryFdKHR)(VkDevice, const VkMemoryGetFdInfoKHR*, int*) = (void*) vkGetInstanceProcAddr(buffers->instance, "vkGetMemoryFdKHR");
+    int fd = -1;
+    VkResult res = vkGetMemoryFdKHR ? vkGetMemoryFdKHR(buffers->device, &(VkMemoryGetFdInfoKHR) {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_GET_FD_INFO_KHR,
+        .pNext = NULL,
+        .memory = buffers->memory[index],
+        .handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_OPAQUE_FD_BIT_KHR
+    }, &fd) : VK_ERROR_INITIALIZATION_FAILED;
+    if (res != VK_SUCCESS || fd < 0) {
+        blog(LOG_ERROR, "Failed to get capture buffer fd: %d", res);
+        return 0;
+    }
+
+    // bind it to a gl memory object (which owns the fd once the import succeeded)
+    GLuint memory_object = 0;
+    glCreateMemoryObjectsEXT(1, &memory_object);
+    int glstatus;
+    if ((glstatus = glGetError())) {
+        blog(LOG_ERROR, "Failed to create memory object: %d", glstatus);
+        close(fd);
+        return 0;
+    }
+    glMemoryObjectParameterivEXT(memory_object, GL_DEDICATED_MEMORY_OBJECT_EXT, &(GLint) { GL_TRUE });
+    glImportMemoryFdEXT(memory_object, buffers->size[index], GL_HANDLE_TYPE_OPAQUE_FD_EXT, fd);
+    if ((glstatus = glGetError())) {
+        blog(LOG_ERROR, "Failed to import memory fd: %d", glstatus);
+        glDeleteMemoryObjectsEXT(1, &memory_object);
+        close(fd);
+        return 0;
+    }
+
+    *free_entry = (import_entry) {
+        .memory = buffers->memory[index],
+        .size = buffers->size[index],
+        .memory_object = memory_object,
+        .refs = 1,
+        .frees = frees
+    };
+    return memory_object;
+}
+
+/**
+ * Find the import holding a memory object
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param memory_object
+ *   Memory object returned by acquire_import()
+ *
+ * \return
+ *   Import, or NULL if the memory object isn't imported
+ */
+static import_entry* find_import(GLuint memory_object) {
+    for (int i = 0; memory_object && i < IMPORT_CACHE_SIZE; i++) {
+        if (imports[i].memory_object == memory_object)
+            return &imports[i];
+    }
+    return NULL;
+}
+
+/**
+ * Give up a session's use of an import
+ *
+ * The import stays cached until the hooks see its buffer freed, so a session
+ * restarted on the same buffers doesn't import them again.
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param hooks
+ *   Hook state
+ * \param memory_object
+ *   Memory object returned by acquire_import()
+ */
+static void release_import(NvFBCCustomState* hooks, GLuint memory_object) {
+    import_entry* entry = find_import(memory_object);
+    if (entry && !--entry->refs && hooks_freed_since(hooks, entry->memory, &entry->frees))
+        drop_import(entry);
+}
+
+/**
+ * Load the GL extension functions
+ *
+ * \author
+ *   PancakeTAS
+ */
+static void load_functions() {
+    if (glCreateMemoryObjectsEXT)
+        return;
+
+    glCreateMemoryObjectsEXT = (void*) eglGetProcAddress("glCreateMemoryObjectsEXT");
+    glMemoryObjectParameterivEXT = (void*) eglGetProcAddress("glMemoryObjectParameterivEXT");
+    glImportMemoryFdEXT = (void*) eglGetProcAddress("glImportMemoryFdEXT");
+    glTextureStorageMem2DEXT = (void*) eglGetProcAddress("glTextureStorageMem2DEXT");
+    glDeleteMemoryObjectsEXT = (void*) eglGetProcAddress("glDeleteMemoryObjectsEXT");
+}
+
+/**
+ * Wrap one of NvFBC's Vulkan buffers in a texture through a DMA-BUF
+ *
+ * Only buffers holding an image the hooks created with a modifier can be
+ * shared, the modifier and layout the driver picked describe the DMA-BUF.
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param params
+ *   Capture parameters
+ * \param index
+ *   Index of the buffer
+ *
+ * \return
+ *   Texture sharing the buffer, or NULL if it can't be shared as a DMA-BUF
+ */
+static gs_texture_t* wrap_buffer(capture_params* params, int index) {
+    nvfbc_user* user_data = (nvfbc_user*) params->user_data;
+    hook_image* image = &user_data->buffers->bound[index];
+    if (user_data->lost || user_data->dmabuf_failed || !image->image)
+        return NULL;
+
+    // export the memory of the image (the texture holds its own reference)
+    VkResult (*vkGetMemoryFdKHR)(VkDevice, const VkMemoryGetFdInfoKHR*, int*) = (void*) vkGetInstanceProcAddr(user_data->buffers->instance, "vkGetMemoryFdKHR");
+    int fd = -1;
+    VkResult res = vkGetMemoryFdKHR ? vkGetMemoryFdKHR(user_data->buffers->device, &(VkMemoryGetFdInfoKHR) {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_GET_FD_INFO_KHR,
+        .pNext = NULL,
+        .memory = user_data->buffers->memory[index],
+        .handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT
+    }, &fd) : VK_ERROR_INITIALIZATION_FAILED;
+    if (res != VK_SUCCESS || fd < 0) {
+        blog(LOG_WARNING, "Failed to export capture buffer %d as DMA-BUF: %d", index, res);
+        user_data->dmabuf_failed = true;
+        return NULL;
+    }
+
+    // NvFBC writes BGRA bytes into the image
+    uint32_t stride = (uint32_t) image->stride;
+    uint32_t offset = (uint32_t) image->offset;
+    uint64_t modifier = image->modifier;
+    gs_texture_t* texture = gs_texture_create_from_dmabuf(image->width, image->height, DRM_FORMAT_ARGB8888, GS_BGRA, 1,
+        &fd, &stride, &offset, &modifier);
+    close(fd);
+    if (!texture) {
+        blog(LOG_WARNING, "Failed to import capture buffer %d with modifier %#llx", index, (unsigned long long) modifier);
+        user_data->dmabuf_failed = true;
+        return NULL;
+    }
+
+    blog(LOG_DEBUG, "Shared capture buffer %d as DMA-BUF with modifier %#llx", index, (unsigned long long) modifier);
+    return texture;
+}
+
+/**
+ * Back the source's textures with NvFBC's Vulkan buffers
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param params
+ *   Capture parameters
+ *
+ * \return
+ *   True if the textures were exported, false otherwise
+ */
+static bool export_textures(capture_params* params) {
+    nvfbc_user* user_data = (nvfbc_user*) params->user_data;
+    if (user_data->lost)
+        return false;
+
+    // images with a modifier aren't laid out the way GL's own storage would be, the next session keeps NvFBC's images
+    for (int i = 0; i < NVFBC_TOGL_TEXTURES_MAX; i++) {
+        if (user_data->buffers->bound[i].image) {
+            blog(LOG_ERROR, "Failed to share capture buffer %d as DMA-BUF", i);
+            params->opaque_buffers = true;
+            return false;
+        }
+    }
+
+    load_functions();
+
+    // hook textures
+    int glstatus;
+    for (int i = 0; i < NVFBC_TOGL_TEXTURES_MAX; i++) {
+        if (!user_data->memory_objects[i])
+            user_data->memory_objects[i] = acquire_import((NvFBCCustomState*) backend_hooks(), user_data->buffers, i);
+        if (!user_data->memory_objects[i])
+            return false;
+
+        // (storage of a texture can't be replaced, every texture gets its own)
+        glTextureStorageMem2DEXT(params->textures[i], 1, GL_RGBA8, params->frame_width, params->frame_height, user_data->memory_objects[i], 0);
+        if ((glstatus = glGetError())) {
+            blog(LOG_ERROR, "Failed to create texture storage: %d", glstatus);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Fence OBS's reads of a texture
+ *
+ * Called once per OBS frame, the fence covers every draw of the frame before.
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param params
+ *   Capture parameters
+ * \param texture
+ *   Index of the texture that was drawn
+ */
+static void sample_texture(capture_params* params, int texture) {
+    nvfbc_user* user_data = (nvfbc_user*) params->user_data;
+    if (user_data->lost || texture < 0 || texture >= NVFBC_TOGL_TEXTURES_MAX)
+        return;
+
+    EGLDisplay display = eglGetCurrentDisplay();
+    EGLSync fence = eglCreateSync(display, EGL_SYNC_FENCE, NULL);
+    if (fence == EGL_NO_SYNC)
+        return;
+
+    // the grabbing thread waits without OBS's context, so the fence has to reach the GPU now
+    glFlush();
+
+    // a newer fence covers every earlier draw (OBS draws everything on one context)
+    pthread_mutex_lock(&user_data->fence_lock);
+    EGLSync older = user_data->fences[texture];
+    user_data->fences[texture] = fence;
+    user_data->display = display;
+    pthread_mutex_unlock(&user_data->fence_lock);
+    if (older != EGL_NO_SYNC)
+        eglDestroySync(display, older);
+}
+
+/**
+ * Wait for the GPU to finish OBS's reads of the buffer NvFBC captures into next
+ *
+ * The graphics thread never waits, it only checks whether the reads are done.
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param user_data
+ *   NvFBC user data
+ * \param block
+ *   Whether to wait for the reads (capture thread only)
+ *
+ * \return
+ *   True if the buffer can be captured into, false if OBS is still reading it
+ */
+static bool wait_sampled(nvfbc_user* user_data, bool block) {
+    pthread_mutex_lock(&user_data->fence_lock);
+    EGLSync fence = user_data->fences[user_data->next_texture];
+    EGLDisplay display = user_data->display;
+    pthread_mutex_unlock(&user_data->fence_lock);
+    if (fence == EGL_NO_SYNC)
+        return true;
+
+    // (the graphics thread is the one setting the fences, so without blocking the fence can't change meanwhile)
+    if (!block) {
+        if (eglClientWaitSync(display, fence, 0, 0) == EGL_TIMEOUT_EXPIRED)
+            return false;
+        pthread_mutex_lock(&user_data->fence_lock);
+        user_data->fences[user_data->next_texture] = EGL_NO_SYNC;
+        pthread_mutex_unlock(&user_data->fence_lock);
+        eglDestroySync(display, fence);
+        return true;
+    }
+
+    // take the fence, so a newer one doesn't destroy it while it is waited on
+    pthread_mutex_lock(&user_data->fence_lock);
+    fence = user_data->fences[user_data->next_texture];
+    user_data->fences[user_data->next_texture] = EGL_NO_SYNC;
+    pthread_mutex_unlock(&user_data->fence_lock);
+    if (fence == EGL_NO_SYNC)
+        return true;
+
+    // (a fence that doesn't signal in time only risks a torn frame, not a stalled capture)
+    uint64_t start = timing_begin(STAGE_SYNC);
+    eglClientWaitSync(display, fence, 0, SAMPLE_TIMEOUT_NS);
+    timing_end(user_data->session.timings, STAGE_SYNC, start);
+    eglDestroySync(display, fence);
+    return true;
+}
+
+/**
+ * Capture frame
+ *
+ * The first grab on a thread takes ownership of the NvFBC context, later grabs reuse it.
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param params
+ *   Capture parameters
+ * \param frame
+ *   Grabbed frame
+ *
+ * \return
+ *   True if a frame was captured, false otherwise
+ */
+static bool capture_frame(capture_params* params, frame_info* frame) {
+    nvfbc_user* user_data = (nvfbc_user*) params->user_data;
+
+    // a session that failed (or whose context can't be bound) can't grab until it is rebuilt
+    if (user_data->lost || !session_bind(&user_data->session)) {
+        frame->status = 0;
+        frame->lost = user_data->lost = true;
+        user_data->stats.failures++;
+        return false;
+    }
+
+    // capture frame once OBS is done reading the buffer it goes into (the graphics thread skips the grab until then)
+    if (!wait_sampled(user_data, params->threaded)) {
+        frame->is_new = false;
+        return true;
+    }
+    NVFBC_FRAME_GRAB_INFO grab_info = { 0 };
+    NVFBC_TOGL_GRAB_FRAME_PARAMS grab_params = {
+        .dwVersion = NVFBC_TOGL_GRAB_FRAME_PARAMS_VER,
+        .pFrameGrabInfo = &grab_info
+    };
+    session_grab_flags(params->mode, &grab_params.dwFlags, &grab_params.dwTimeoutMs);
+    NVFBCSTATUS status = fbc.nvFBCToGLGrabFrame(user_data->session.handle, &grab_params);
+    if (status) {
+        frame->status = status;
+        frame->lost = user_data->lost = session_lost(status);
+        user_data->stats.failures++;
+        return false;
+    }
+
+    // switch textures
+    frame->texture = grab_params.dwTextureIndex;
+    frame->width = grab_info.dwWidth;
+    frame->height = grab_info.dwHeight;
+    user_data->next_texture = (grab_params.dwTextureIndex + 1) % NVFBC_TOGL_TEXTURES_MAX;
+    frame->is_new = grab_info.bIsNewFrame;
+    frame->number = grab_info.dwCurrentFrame;
+    frame->timestamp_us = grab_info.ulTimestampUs;
+
+    // NvFBC's Vulkan writes have to be done before GL reads the buffer, the capture thread waits for them
+    if (frame->is_new && params->threaded && user_data->device_wait_idle) {
+        uint64_t start = timing_begin(STAGE_SYNC);
+        user_data->device_wait_idle(user_data->buffers->device);
+        timing_end(user_data->session.timings, STAGE_SYNC, start);
+    }
+
+    // look at what changed
+    frame->diffmap = params->with_diffmap ? user_data->diffmap : NULL;
+    frame->changed_area = session_changed_area(frame->diffmap, params->diffmap_width, params->diffmap_height);
+
+    user_data->stats.grabs++;
+    if (frame->is_new)
+        user_data->stats.new_frames++;
+    return true;
+}
+
+/**
+ * Release the NvFBC context from the calling thread
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param params
+ *   Capture parameters
+ */
+static void release_capture(capture_params* params) {
+    session_release(&((nvfbc_user*) params->user_data)->session);
+}
+
+/**
+ * Read the capture statistics
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param params
+ *   Capture parameters
+ * \param stats
+ *   Statistics since start
+ */
+static void get_stats(capture_params* params, backend_stats* stats) {
+    *stats = ((nvfbc_user*) params->user_data)->stats;
+}
+
+/**
+ * Stop capture
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param params
+ *  Capture parameters
+ */
+static void stop_capture(capture_params* params) {
+    blog(LOG_INFO, "Stopping capture");
+    nvfbc_user* user_data = (nvfbc_user*) params->user_data;
+
+    // destroy NvFBC session
+    session_destroy(&user_data->session);
+
+    // release the imports (the buffers NvFBC freed with the session are dropped)
+    for (int i = 0; i < NVFBC_TOGL_TEXTURES_MAX; i++) {
+        if (user_data->memory_objects[i])
+            release_import((NvFBCCustomState*) backend_hooks(), user_data->memory_objects[i]);
+    }
+
+    // hand the buffer slot back (NvFBC freed the buffers with the session)
+    if (user_data->buffers)
+        atomic_store_explicit(&user_data->buffers->state, HOOK_SESSION_FREE, memory_order_release);
+
+    // destroy pending fences
+    for (int i = 0; i < NVFBC_TOGL_TEXTURES_MAX; i++) {
+        if (user_data->fences[i] != EGL_NO_SYNC)
+            eglDestroySync(user_data->display, user_data->fences[i]);
+    }
+
+    // free user data
+    pthread_mutex_destroy(&user_data->fence_lock);
+    free(user_data);
+}
+
+const capture_backend togl_backend = {
+    .id = "togl",
+    .name = "NvFBC to OpenGL (zero copy)",
+    .capabilities = togl_capabilities,
+    .texture_count = NVFBC_TOGL_TEXTURES_MAX,
+    .prepare = prepare_capture,
+    .start = start_capture,
+    .wrap_buffer = wrap_buffer,
+    .export_textures = export_textures,
+    .grab = capture_frame,
+    .release = release_capture,
+    .sampled = sample_texture,
+    .get_stats = get_stats,
+    .stop = stop_capture
+};
@@ -0,0 +1,194 @@
+#include "backend.h"
+#include "session.h"
+
+#include <obs/obs-module.h>
+#include <NvFBC.h>
+
+typedef struct {
+    fbc_session session; //!< NvFBC session
+    void* buffer; //!< Frame buffer (owned and reallocated by NvFBC)
+    void* diffmap; //!< Differential map buffer (owned and reallocated by NvFBC)
+    bool lost; //!< Whether the session failed to start or was lost
+    backend_stats stats; //!< Statistics since start
+} nvfbc_sys_user; //!< NvFBC system memory user data
+
+/**
+ * Return the capabilities of the ToSys backend
+ *
+ * NvFBC does its own GL post processing for system memory capture,
+ * which the preload hooks (and the Vulkan layer) stub out.
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \return
+ *   Capabilities, 0 without NvFBC or with the preload hooks or the Vulkan layer
+ */
+static uint32_t tosys_capabilities() {
+    if (!fbc.nvFBCCreateHandle || backend_hooks())
+        return 0;
+
+    return BACKEND_CAP_SYSTEM_MEMORY | BACKEND_CAP_YUV | BACKEND_CAP_DIFFMAP;
+}
+
+/**
+ * Start system memory capture
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param params
+ *   Capture parameters
+ */
+static void start_sys_capture(capture_params* params) {
+    blog(LOG_INFO, "Starting system memory capture");
+
+    nvfbc_sys_user* user_data = (nvfbc_sys_user*) calloc(1, sizeof(nvfbc_sys_user));
+    params->user_data = user_data;
+
+    // create NvFBC session
+    if (!session_create(&user_data->session, params, NVFBC_CAPTURE_TO_SYS)) {
+        user_data->lost = true;
+        return;
+    }
+
+    // setup ToSys capture
+    NVFBC_TOSYS_SETUP_PARAMS setup_params = {
+        .dwVersion = NVFBC_TOSYS_SETUP_PARAMS_VER,
+        .eBufferFormat = params->format == PIXEL_FORMAT_NV12 ? NVFBC_BUFFER_FORMAT_NV12
+            : params->format == PIXEL_FORMAT_I444 ? NVFBC_BUFFER_FORMAT_YUV444P
+            : NVFBC_BUFFER_FORMAT_BGRA,
+        .ppBuffer = &user_data->buffer,
+        .bWithDiffMap = params->with_diffmap,
+        .ppDiffMap = &user_data->diffmap,
+        .dwDiffMapScalingFactor = params->diffmap_scale
+    };
+    NVFBCSTATUS status = fbc.nvFBCToSysSetUp(user_data->session.handle, &setup_params);
+    if (status) {
+        blog(LOG_ERROR, "Failed to setup NvFBC ToSys capture: %d", status);
+        user_data->lost = true;
+        return;
+    }
+    params->diffmap_width = params->with_diffmap ? setup_params.diffMapSize.w : 0;
+    params->diffmap_height = params->with_diffmap ? setup_params.diffMapSize.h : 0;
+}
+
+/**
+ * Capture frame into system memory
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param params
+ *   Capture parameters
+ * \param frame
+ *   Grabbed frame
+ *
+ * \return
+ *   True if a frame was captured, false otherwise
+ */
+static bool capture_sys_frame(capture_params* params, frame_info* frame) {
+    nvfbc_sys_user* user_data = (nvfbc_sys_user*) params->user_data;
+
+    // a session that failed (or whose context can't be bound) can't grab until it is rebuilt
+    if (user_data->lost || !session_bind(&user_data->session)) {
+        frame->status = 0;
+        frame->lost = user_data->lost = true;
+        user_data->stats.failures++;
+        return false;
+    }
+
+    // capture frame
+    NVFBC_FRAME_GRAB_INFO grab_info = { 0 };
+    NVFBC_TOSYS_GRAB_FRAME_PARAMS grab_params = {
+        .dwVersion = NVFBC_TOSYS_GRAB_FRAME_PARAMS_VER,
+        .pFrameGrabInfo = &grab_info
+    };
+    session_grab_flags(params->mode, &grab_params.dwFlags, &grab_params.dwTimeoutMs);
+    NVFBCSTATUS status = fbc.nvFBCToSysGrabFrame(user_data->session.handle, &grab_params);
+    if (status) {
+        frame->status = status;
+        frame->lost = user_data->lost = session_lost(status);
+        user_data->stats.failures++;
+        return false;
+    }
+
+    // NvFBC may have reallocated the buffer, so always pass on the current one
+    frame->data = user_data->buffer;
+    frame->linesize = params->format == PIXEL_FORMAT_BGRA ? grab_info.dwWidth * 4 : grab_info.dwWidth;
+    frame->width = grab_info.dwWidth;
+    frame->height = grab_info.dwHeight;
+    frame->is_new = grab_info.bIsNewFrame;
+    frame->number = grab_info.dwCurrentFrame;
+    frame->timestamp_us = grab_info.ulTimestampUs;
+
+    // look at what changed
+    frame->diffmap = params->with_diffmap ? user_data->diffmap : NULL;
+    frame->changed_area = session_changed_area(frame->diffmap, params->diffmap_width, params->diffmap_height);
+
+    user_data->stats.grabs++;
+    if (frame->is_new) {
+        user_data->stats.new_frames++;
+        user_data->stats.bytes += grab_info.dwByteSize;
+    }
+    return true;
+}
+
+/**
+ * Release the NvFBC context from the calling thread
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param params
+ *   Capture parameters
+ */
+static void release_sys_capture(capture_params* params) {
+    session_release(&((nvfbc_sys_user*) params->user_data)->session);
+}
+
+/**
+ * Read the capture statistics
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param params
+ *   Capture parameters
+ * \param stats
+ *   Statistics since start
+ */
+static void get_sys_stats(capture_params* params, backend_stats* stats) {
+    *stats = ((nvfbc_sys_user*) params->user_data)->stats;
+}
+
+/**
+ * Stop system memory capture
+ *
+ * \author
+ *   PancakeTAS
+ *
+ * \param params
+ *   Capture parameters
+ */
+static void stop_sys_capture(capture_params* params) {
+    blog(LOG_INFO, "Stopping system memory capture");
+    nvfbc_sys_user* user_data = (nvfbc_sys_user*) params->user_data;
+
+    // destroy NvFBC session (this also frees the buffers)
+    session_destroy(&user_data->session);
+
+    // free user data
+    free(user_data);
+}
+
+const capture_backend tosys_backend = {
+    .id = "tosys",
+    .name = "NvFBC to system memory",
+    .capabilities = tosys_capabilities,
+    .start = start_sys_capture,
+    .grab = capture_sys_frame,
+    .release = release_sys_capture,
+    .get_stats = get_sys_stats,
+    .stop = stop_sys_capture
+};